@@ -37,25 +37,39 @@
  #include "gpio.h"
 #include <driver/gpio.h>
 #include <event.h>
+#include "hardware.h"
 
 int SET_PIN;
+int WRITE_PIN;
 int GET_PIN;
 
 static int pin_event[GPIO_PIN_COUNT];
 
-void gpio_init(QueueHandle_t queue)
+static void handle_set_pin(Event *event);
+static void handle_write_pin(Event *event);
+static void handle_get_pin(Event *event);
+
+void gpio_init()
 {
+	// Modes and interrupts are not coalesced; every one of them matters.
 	SET_PIN = event_new("set_pin",
 		(const char *[6]) { "pin", "mode", "event", NULL, NULL, NULL },
 		(const char *[3]) { NULL, NULL, NULL },
-		(const char *[3]) { NULL, NULL, NULL });
-	event_claim(SET_PIN, true, queue);
+		(const char *[3]) { NULL, NULL, NULL }, 0);
+	hardware_claim(SET_PIN, &handle_set_pin, true);
+
+	// Only the newest output level of every pin matters.
+	WRITE_PIN = event_new("write_pin",
+		(const char *[6]) { "pin", "level", NULL, NULL, NULL, NULL },
+		(const char *[3]) { NULL, NULL, NULL },
+		(const char *[3]) { NULL, NULL, NULL }, EVENT_COALESCE_KEY);
+	hardware_claim(WRITE_PIN, &handle_write_pin, true);
 
 	GET_PIN = event_new("get_pin",
 		(const char *[6]) { "pin", "event", NULL, NULL, NULL, NULL },
 		(const char *[3]) { NULL, NULL, NULL },
-		(const char *[3]) { NULL, NULL, NULL });
-	event_claim(GET_PIN, true, queue);
+		(const char *[3]) { NULL, NULL, NULL }, 0);
+	hardware_claim(GET_PIN, &handle_get_pin, true);
 
 	const char *constants[]
 		= { "LOW", "HIGH", "FLOATING", "PULLUP", "PULLDOWN",
@@ -75,14 +89,12 @@ static void IRAM_ATTR gpio_interrupt_handler(void *args)
 
 	Event event = {
 		.eventcode = pin_event[pin],
+		.t = event_now(),
 	};
 	event.i[0] = pin;
-	if (event.eventcode >= 1 && event.eventcode < MAX_EVENTS) {
-		EventType *def = &event_defs[event.eventcode];
-		if (def->name != NULL && def->queue != NULL) {
-			xQueueSendFromISR(def->queue, &event, NULL);
-		}
-	}
+	// The level after the edge, for events that are defined with two ints.
+	event.i[1] = gpio_get_level(pin);
+	event_send_from_isr(&event);
 }
 
 static bool register_interrupt(int pin, bool rising, bool falling, int e)
@@ -114,65 +126,72 @@ static bool register_interrupt(int pin, bool rising, bool falling, int e)
 	return true;
 }
 
-bool gpio_event(Event *event)
+static void handle_get_pin(Event *event)
+{
+	int pin = event->i[0];
+	int cb = event->i[1];
+	int value;
+	if (pin < 0 || pin >= GPIO_PIN_COUNT) {
+		// invalid pin.
+		value = -1;
+	} else {
+		value = gpio_get_level(pin);
+	}
+	Event reply = { .eventcode = cb, .t = event_now(), };
+	reply.i[0] = value;
+	event_reply(event, &reply);
+}
+
+static void handle_set_pin(Event *event)
 {
-	if (event->eventcode == GET_PIN) {
-		int pin = event->i[0];
-		int cb = event->i[1];
-		int value;
-		if (pin < 0 || pin >= GPIO_PIN_COUNT) {
-			// invalid pin.
-			value = -1;
-		} else {
-			value = gpio_get_level(pin);
-		}
-		Event event = { .eventcode = cb, };
-		event.i[0] = value;
-		event_send(&event);
-		return true;
-	} else if (event->eventcode == SET_PIN) {
-		int pin = event->i[0];
-		int mode = event->i[1];
-		int e = event->i[2];	// Only used for interrupts.
-		//printf(_("dbg: gpio event %d for pin %d\n"), mode, pin);
-		event_free(event);
-		switch (mode) {
-		case GPIO_LOW:
-			gpio_set_direction(pin, GPIO_MODE_OUTPUT);
-			gpio_set_level(pin, 0);
-			gpio_set_pull_mode(pin, GPIO_FLOATING);
-			break;
-		case GPIO_HIGH:
-			gpio_set_direction(pin, GPIO_MODE_OUTPUT);
-			gpio_set_level(pin, 1);
-			gpio_set_pull_mode(pin, GPIO_FLOATING);
-			break;
-		case GPIO_FLOAT:
-			gpio_set_direction(pin, GPIO_MODE_DISABLE);
-			gpio_set_pull_mode(pin, GPIO_FLOATING);
-			break;
-		case GPIO_PULLUP:
-			gpio_set_direction(pin, GPIO_MODE_INPUT);
-			gpio_set_pull_mode(pin, GPIO_PULLUP_ONLY);
-			break;
-		case GPIO_PULLDOWN:
-			gpio_set_direction(pin, GPIO_MODE_INPUT);
-			gpio_set_pull_mode(pin, GPIO_PULLDOWN_ONLY);
-			break;
-		case GPIO_RISING:
-			register_interrupt(pin, true, false, e);
-			break;
-		case GPIO_FALLING:
-			register_interrupt(pin, false, true, e);
-			break;
-		case GPIO_CHANGE:
-			register_interrupt(pin, true, true, e);
-			break;
-		default:
-			// Unknown event.
-			printf(_("unknown gpio event %d for pin %d\n"), mode, pin);
-		}
-		return true;
+	int pin = event->i[0];
+	int mode = event->i[1];
+	int e = event->i[2];	// Only used for interrupts.
+	//printf(_("dbg: gpio event %d for pin %d\n"), mode, pin);
+	switch (mode) {
+	case GPIO_LOW:
+		gpio_set_direction(pin, GPIO_MODE_OUTPUT);
+		gpio_set_level(pin, 0);
+		gpio_set_pull_mode(pin, GPIO_FLOATING);
+		break;
+	case GPIO_HIGH:
+		gpio_set_direction(pin, GPIO_MODE_OUTPUT);
+		gpio_set_level(pin, 1);
+		gpio_set_pull_mode(pin, GPIO_FLOATING);
+		break;
+	case GPIO_FLOAT:
+		gpio_set_direction(pin, GPIO_MODE_DISABLE);
+		gpio_set_pull_mode(pin, GPIO_FLOATING);
+		break;
+	case GPIO_PULLUP:
+		gpio_set_direction(pin, GPIO_MODE_INPUT);
+		gpio_set_pull_mode(pin, GPIO_PULLUP_ONLY);
+		break;
+	case GPIO_PULLDOWN:
+		gpio_set_direction(pin, GPIO_MODE_INPUT);
+		gpio_set_pull_mode(pin, GPIO_PULLDOWN_ONLY);
+		break;
+	case GPIO_RISING:
+		register_interrupt(pin, true, false, e);
+		break;
+	case GPIO_FALLING:
+		register_interrupt(pin, false, true, e);
+		break;
+	case GPIO_CHANGE:
+		register_interrupt(pin, true, true, e);
+		break;
+	default:
+		// Unknown event.
+		printf(_("unknown gpio event %d for pin %d\n"), mode, pin);
+	}
+}
+
+static void handle_write_pin(Event *event)
+{
+	int level = event->i[1];
+	if (level != GPIO_LOW && level != GPIO_HIGH) {
+		printf(_("invalid level %d for pin %d\n"), level, event->i[0]);
+		return;
 	}
-	return false;
+	handle_set_pin(event);
 }
@@ -50,8 +50,6 @@ typedef enum GpioState {
 	GPIO_CHANGE		// with pullup
 } GpioState;
 
-extern int PIN_CHANGE, SET_PIN;
+extern int PIN_CHANGE, SET_PIN, WRITE_PIN;
 
-void gpio_init(QueueHandle_t queue);
-
-bool gpio_event(Event *event);
+void gpio_init();
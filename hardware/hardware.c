@@ -42,43 +42,86 @@
 #include "i2c.h"
 #include <event.h>
 
-#define QUEUE_LENGTH 50
+// Events are received in two lanes. The high priority lane is for events that
+// must not wait: motor control, servos and gpio. The low priority lane is for
+// LED updates and I2C transactions, which can be slow.
+#define HIGH_QUEUE_LENGTH CONFIG_EVENT_HARDWARE_HIGH_QUEUE_LENGTH
+#define LOW_QUEUE_LENGTH CONFIG_EVENT_HARDWARE_LOW_QUEUE_LENGTH
+
+static EventQueue high, low;
+
+// Handlers of claimed events and their full codes, indexed by EVENT_INDEX.
+static HardwareHandler handlers[MAX_EVENTS];
+static int claimed[MAX_EVENTS];
+
+// Number of received events without a handler.
+static unsigned unhandled;
+
+bool hardware_claim(int eventcode, HardwareHandler handler, bool high_priority)
+{
+	if (handler == NULL)
+		return false;
+	// This rejects codes that are not defined, including stale ones.
+	if (!event_claim(eventcode, EVENT_DELIVER_RAW,
+		high_priority ? high : low))
+		return false;
+	int index = EVENT_INDEX(eventcode);
+	handlers[index] = handler;
+	claimed[index] = eventcode;
+	return true;
+}
 
 void hardware_task(void *arg)
 {
 	(void)&arg;
-	QueueHandle_t queue = xQueueCreate(QUEUE_LENGTH, sizeof(Event));
+	high = event_queue_create(HIGH_QUEUE_LENGTH);
+	low = event_queue_create(LOW_QUEUE_LENGTH);
+	// The set needs an entry for every event that can be pending. Events
+	// with few parameters take less room, so that is more than the queue
+	// lengths: an event without parameters takes half a slot.
+	QueueSetHandle_t lanes =
+		xQueueCreateSet(event_queue_max_items(HIGH_QUEUE_LENGTH) +
+			event_queue_max_items(LOW_QUEUE_LENGTH));
+	xRingbufferAddToQueueSetRead(high, lanes);
+	xRingbufferAddToQueueSetRead(low, lanes);
 
-	gpio_init(queue);
-	led_init(queue, 1);
-	pwm_init(queue);
-	i2c_init(queue);
-	motor_init(queue);
+	gpio_init();
+	led_init();
+	pwm_init();
+	i2c_init();
+	motor_init();
 
 	while (true) {
 		Event event;
-		if (!event_wait(-1, &event, queue)) {
+		if (xQueueSelectFromSet(lanes, portMAX_DELAY) == NULL) {
 			// Should not happen.
 			printf(_("hardware event timed out?!\n"));
 			continue;
 		}
-
-		if (gpio_event(&event))
-			continue;
-
-		if (led_event(&event))
-			continue;
-
-		if (pwm_event(&event))
-			continue;
-		
-		if (i2c_event(&event))
-			continue;
-		
-		if (motor_event(&event))
+		// Every event that is sent to either queue adds an entry to the set,
+		// and one entry is taken for every event that is received. Always
+		// take a pending high priority event first, regardless of which
+		// queue was selected; the entries still add up.
+		if (!event_wait(0, &event, high) && !event_wait(0, &event, low)) {
+			// Should not happen.
+			printf(_("hardware event lane is empty?!\n"));
 			continue;
+		}
+		uint32_t start = event_now();
 
-		// Unrecognized event.
+		// An event with an old code of the entry is not handled.
+		int index = EVENT_INDEX(event.eventcode);
+		HardwareHandler handler = claimed[index] == event.eventcode ?
+			handlers[index] : NULL;
+		if (handler != NULL) {
+			handler(&event);
+			event_handled(&event, start);
+		} else {
+			// Unrecognized event.
+			++unhandled;
+			printf(_("Unhandled hardware event %s (%u so far)\n"),
+				event_get_name(event.eventcode), unhandled);
+		}
 
 		// Clean up.
 		event_free(&event);
@@ -33,5 +33,24 @@
  * # COPYRIGHT(C) Pink Fluffy Unicorns 2025                                  #
  * # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # #
  */
+#ifndef HARDWARE_H
+#define HARDWARE_H
+
+#include <event.h>
+
+// Function that handles one event type. The event is freed after it returns.
+typedef void (*HardwareHandler)(Event *event);
+
+/// @brief Claim an event for the hardware task. This is used by drivers during
+/// initialization.
+/// @param eventcode The event to claim.
+/// @param handler The function that handles the event.
+/// @param high_priority Whether the event is handled before pending low
+/// priority events. Use this for events that must not be delayed by slow
+/// operations, such as motor control.
+/// @return False in case of error.
+bool hardware_claim(int eventcode, HardwareHandler handler, bool high_priority);
 
 void hardware_task(void *arg);
+
+#endif
@@ -41,5 +41,4 @@
 #include <esp_log.h>
 #include <event.h>
 
-void i2c_init(QueueHandle_t queue);
-bool i2c_event(Event *event);
+void i2c_init();
@@ -40,6 +40,7 @@
 
 #include <neopixel.h>
 #include <event.h>
+#include "hardware.h"
 
 #define NEOPIXEL_PIN GPIO_NUM_4
 
@@ -47,45 +48,55 @@ static tNeopixelContext neopixel;
 static int SET_LED;
 static int num_pixels;
 
-void led_init(QueueHandle_t queue)
+// Pixels that have been set in the current batch, but not sent to the LEDs yet.
+static tNeopixel pending[MAX_BATCH];
+static int num_pending;
+
+static void handle_set_led(Event *event);
+
+void led_init()
 {
 	num_pixels = 12;
 	neopixel = neopixel_Init(num_pixels, NEOPIXEL_PIN);
 	SET_LED = event_new("set_LED",
 		(const char *[6]) { "pixel", "red", "green", "blue", NULL, NULL },
 		(const char *[3]) { NULL, NULL, NULL },
-		(const char *[3]) { NULL, NULL, NULL });
-	event_claim(SET_LED, true, queue);
+		(const char *[3]) { NULL, NULL, NULL }, 0);
+	hardware_claim(SET_LED, &handle_set_led, false);
 	//printf(_("set LED event code: %d\n"), SET_LED);
 }
 
-bool led_event(Event *event)
+static void flush_pixels()
 {
-	if (event->eventcode != SET_LED)
-		return false;
+	neopixel_SetPixel(neopixel, pending, num_pending);
+	num_pending = 0;
+}
+
+static void handle_set_led(Event *event)
+{
+	// Index -1 is a special case: update LEDs without changing any.
 	int index = event->i[0];
-	if (index == -1) {
-		// Special case: update LEDs without changing any.
-		neopixel_SetPixel(neopixel, NULL, 0);
-		return true;
-	}
-	if (index < 0) {
+	if (index < -1) {
 		printf(_("Invalid pixel %d addressed; maximum is %d.\n"),
 			index, num_pixels);
-		return true;
-	}
-	if (index > num_pixels) {
-		if (neopixel != NULL)
-			neopixel_Deinit(neopixel);
-		num_pixels = index + 1;
-		neopixel = neopixel_Init(num_pixels, NEOPIXEL_PIN);
+	} else if (index >= 0) {
+		if (index > num_pixels) {
+			flush_pixels();
+			if (neopixel != NULL)
+				neopixel_Deinit(neopixel);
+			num_pixels = index + 1;
+			neopixel = neopixel_Init(num_pixels, NEOPIXEL_PIN);
+		}
+		int red = event->i[1];
+		int green = event->i[2];
+		int blue = event->i[3];
+		//printf(_("Set LED %d to %d, %d, %d\n"), index, red, green, blue);
+		pending[num_pending].index = index;
+		pending[num_pending].rgb = NP_RGB(red, green, blue);
+		++num_pending;
 	}
-	int red = event->i[1];
-	int green = event->i[2];
-	int blue = event->i[3];
-	event_free(event);
-	tNeopixel pixel = { .index = index, .rgb = NP_RGB(red, green, blue) };
-	//printf(_("Set LED %d to %d, %d, %d\n"), index, red, green, blue);
-	neopixel_SetPixel(neopixel, &pixel, 1);
-	return true;
+	// Send all pixels of a batch to the LEDs at once, when it is complete.
+	if (index == -1 || (num_pending > 0 &&
+		(!event->more || num_pending == MAX_BATCH)))
+		flush_pixels();
 }
@@ -41,5 +41,4 @@
 #include <esp_log.h>
 #include <event.h>
 
-void led_init(QueueHandle_t queue, int num_pixels);
-bool led_event(Event *event);
+void led_init();
@@ -42,6 +42,7 @@
 #include <esp_adc/adc_cali.h>
 #include <event.h>
 #include "motor.h"
+#include "hardware.h"
 #include "gpio.h"
 #include "pwm.h"
 
@@ -54,6 +55,14 @@ static const TickType_t interval = 150 / portTICK_PERIOD_MS;
 static const int interval_ms = interval * portTICK_PERIOD_MS;
 static const int safe_step = 10;
 
+// Send an event to the hardware task. If its queue is full, wait for room, but
+// not longer than one iteration; the next iteration sends a new state anyway.
+static void send_hardware(Event *event)
+{
+	if (!event_send_timeout(event, interval_ms))
+		ESP_LOGW(TAG, "unable to send %s", event_get_name(event->eventcode));
+}
+
 // Note: Motor pins are reversed compared to data sheet.
 static const int PIN2 = 38;
 static const int PIN1 = 48;
@@ -61,26 +70,25 @@ static int MOTOR;
 static volatile int target_on_time;
 static volatile int step_per_iteration;
 
-void motor_init(QueueHandle_t queue)
+static void handle_motor(Event *event);
+
+void motor_init()
 {
 	target_on_time = 0;
 	step_per_iteration = 0;
 
-	// Register event for motor controls.
+	// Register event for motor controls. Only the newest target matters.
 	MOTOR = event_new("motor",
 		(const char *[6]) { "power", "time", NULL, NULL, NULL, NULL },
 		(const char *[3]) { NULL, NULL, NULL },
-		(const char *[3]) { NULL, NULL, NULL });
-	event_claim(MOTOR, true, queue);
+		(const char *[3]) { NULL, NULL, NULL }, EVENT_COALESCE);
+	hardware_claim(MOTOR, &handle_motor, true);
 
 	xTaskCreate(&motor_task, "motor", 4096, NULL, 0, NULL);
 }
 
-bool motor_event(Event *event)
+static void handle_motor(Event *event)
 {
-	if (event->eventcode != MOTOR)
-		return false;
-
 	// Pass values to motor task through volatile variables.
 	// Power range is -256 to +256.
 	target_on_time = event->i[0];
@@ -97,8 +105,6 @@ bool motor_event(Event *event)
 	if (step_per_iteration == 0)
 		step_per_iteration = 1;
 	//ESP_LOGI(TAG, "steps per iteration: %d", step_per_iteration);
-
-	return true;
 }
 
 void motor_task(void * /*args*/)
@@ -110,6 +116,8 @@ void motor_task(void * /*args*/)
 	TickType_t previous = xTaskGetTickCount();
 	Event event1;
 	Event event2;
+	event1.call = 0;
+	event2.call = 0;
 	for (int i = 0; i < 3; ++i) {
 		event1.s[i] = NULL;
 		event2.s[i] = NULL;
@@ -171,6 +179,9 @@ void motor_task(void * /*args*/)
 		vTaskDelay(0);	// Allow the watchdog to be refreshed.
 		adc_oneshot_get_calibrated_result(oneshot_handle, cali_handle,
 			ADC_CHANNEL_6, &mV);
+		// The events below are a reaction to this measurement.
+		event1.t = event_now();
+		event2.t = event1.t;
 		vTaskDelay(0);	// Allow the watchdog to be refreshed.
 		if (on_time < 0)
 			mV = -mV;
@@ -199,7 +210,7 @@ void motor_task(void * /*args*/)
 			event1.eventcode = SET_PWM;
 			event1.i[0] = 0;
 			event1.i[1] = -1;
-			while (!event_send(&event1)) {}
+			send_hardware(&event1);
 		}
 
 		on_time += step;
@@ -209,7 +220,7 @@ void motor_task(void * /*args*/)
 		if (on_time > 0) {
 			if (on_time > 0x100)
 				on_time = 0x100;
-			event1.eventcode = SET_PIN;
+			event1.eventcode = WRITE_PIN;
 			event1.i[0] = PIN1;
 			event1.i[1] = GPIO_HIGH;
 
@@ -227,7 +238,7 @@ void motor_task(void * /*args*/)
 			event1.i[2] = (0xff - -on_time) << 6;
 			pwm_active = true;
 
-			event2.eventcode = SET_PIN;
+			event2.eventcode = WRITE_PIN;
 			event2.i[0] = PIN2;
 			event2.i[1] = GPIO_HIGH;
 		} else {
@@ -237,18 +248,18 @@ void motor_task(void * /*args*/)
 				event1.eventcode = SET_PWM;
 				event1.i[0] = 0;
 				event1.i[1] = -1;
-				while (!event_send(&event1)) {}
+				send_hardware(&event1);
 			}
 
-			event1.eventcode = SET_PIN;
+			event1.eventcode = WRITE_PIN;
 			event1.i[0] = PIN1;
 			event1.i[1] = GPIO_HIGH;
 
-			event2.eventcode = SET_PIN;
+			event2.eventcode = WRITE_PIN;
 			event2.i[0] = PIN2;
 			event2.i[1] = GPIO_HIGH;
 		}
-		while (!event_send(&event1)) {}
-		while (!event_send(&event2)) {}
+		send_hardware(&event1);
+		send_hardware(&event2);
 	}
 }
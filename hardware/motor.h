@@ -35,5 +35,4 @@
  */
 #include <freertos/FreeRTOS.h>
 
-void motor_init(QueueHandle_t queue);
-bool motor_event(Event *event);
+void motor_init();
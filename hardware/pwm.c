@@ -40,13 +40,16 @@
 #include <driver/ledc.h>
 
 #include <event.h>
+#include "hardware.h"
 
 int SET_PWM;
 static const int num_channels = LEDC_CHANNEL_MAX;
 
 static ledc_channel_config_t channel_config[LEDC_CHANNEL_MAX];
 
-void pwm_init(QueueHandle_t queue)
+static void handle_pwm(Event *event);
+
+void pwm_init()
 {
 	ledc_fade_func_install(0);
 	// configure timers.
@@ -85,26 +88,24 @@ void pwm_init(QueueHandle_t queue)
 		channel_config[c].flags.output_invert = 0;
 	}
 
+	// Only the newest setting of every channel matters.
 	SET_PWM = event_new("pwm",
 		(const char *[6]) { "channel", "pin", "on", NULL, NULL, NULL },
 		(const char *[3]) { NULL, NULL, NULL },
-		(const char *[3]) { NULL, NULL, NULL });
-	event_claim(SET_PWM, true, queue);
+		(const char *[3]) { NULL, NULL, NULL }, EVENT_COALESCE_KEY);
+	hardware_claim(SET_PWM, &handle_pwm, true);
 }
 
-bool pwm_event(Event *event)
+static void handle_pwm(Event *event)
 {
-	if (event->eventcode != SET_PWM)
-		return false;
 	int channel = event->i[0];
 	if (channel < 0) {
 		printf(_("Invalid pwm channel %d addressed (max is %d).\n"), channel,
 			num_channels);
-		return true;
+		return;
 	}
 	int pin = event->i[1];
 	int on = event->i[2];
-	event_free(event);
 
 	if (channel_config[channel].gpio_num >= 0) {
 		// PWM already active.
@@ -112,12 +113,18 @@ bool pwm_event(Event *event)
 			ledc_stop(LEDC_LOW_SPEED_MODE, channel, 0);
 			gpio_reset_pin(channel_config[channel].gpio_num);
 			channel_config[channel].gpio_num = -1;
-			return true;
+			return;
 		}
-		// Change frequency
-
-		ledc_set_duty_and_update(LEDC_LOW_SPEED_MODE, channel, on, 0);
-		return true;
+		if (pin == channel_config[channel].gpio_num) {
+			// Change frequency
+			ledc_set_duty_and_update(LEDC_LOW_SPEED_MODE, channel, on, 0);
+			return;
+		}
+		// Move to another pin. Because the event is coalesced, a request to
+		// stop the old pin first may have been overwritten by this one.
+		ledc_stop(LEDC_LOW_SPEED_MODE, channel, 0);
+		gpio_reset_pin(channel_config[channel].gpio_num);
+		channel_config[channel].gpio_num = -1;
 	}
 
 	// PWM not active yet.
@@ -125,12 +132,11 @@ bool pwm_event(Event *event)
 		ledc_stop(LEDC_LOW_SPEED_MODE, channel, 0);
 		gpio_reset_pin(channel_config[channel].gpio_num);
 		channel_config[channel].gpio_num = -1;
-		return true;
+		return;
 	}
 
 	channel_config[channel].duty = on;
 	channel_config[channel].gpio_num = pin;
 	ledc_channel_config(&channel_config[channel]);
 	//print_system_state();
-	return true;
 }
@@ -43,5 +43,4 @@
 
 extern int SET_PWM;
 
-void pwm_init(QueueHandle_t queue);
-bool pwm_event(Event *event);
+void pwm_init();
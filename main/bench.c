@@ -0,0 +1,509 @@
+/*
+ * # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # #
+ * #                                                                         #
+ * #                              +@@+    .-++-------=*=.                    #
+ * #                             +%%@+-------------------+                   #
+ * #                            =@@+*=---------------------==                #
+ * #                         .%+-=@%*+=----------------------=*.             #
+ * #                        =%---=@=***-------------------------+.           #
+ * #                       .%----=@%#=+%=------------------------*           #
+ * #                        *+---=@**#%-#=----------+:*------------          #
+ * #                        .#+--=@%%#++++=-------+: :*-----------*          #
+ * #                           +##@%#%%%#=#=----*:..:*------------#.         #
+ * #             **%@@@@@@@#+-.                    -=------------+           #
+ * #       .*@%+.         .                       =------------==            #
+ * #    =@=.....         =@+=%%   +@   --        :*-------------             #
+ * #   @*........                 .#@@@-          +------------=:            #
+ * #   @=.......                                  -+---------------++*.      #
+ * #   *%-...-%@.                     ...         .=------------------:      #
+ * #     -@@=...                                   .+----------------#       #
+ * #        =#@%+-..                               ..+-------------=.        #
+ * #                  .:-=*#%%%@@@:                ...=----------+:  +=+:    #
+ * #                            +%                  ...+---------= .-----:   #
+ * #                           :@.                   ...++--------------+    #
+ * #                           %*                     ....+@%#-----%+        #
+ * #                          :@.                      .....+@:              #
+ * #                                                                         #
+ * # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # #
+ * # NAME       = Event benchmarks                                           #
+ * # PROJECT    = Beursgadget 2025 - Circuit-Cruiser                         #
+ * # DATE       = 17-10-2026                                                 #
+ * # AUTHOR     = Bas Wijnen & Jan-Cees Tjepkema                             #
+ * # WEBSITE    = https://pinkfluffyunicorns.nl                              #
+ * # COPYRIGHT(C) Pink Fluffy Unicorns 2025                                  #
+ * # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # #
+ */
+
+#include <sdkconfig.h>
+
+#ifdef CONFIG_EVENT_BENCHMARKS
+
+#include <stdio.h>
+#include <string.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/task.h>
+#include <esp_timer.h>
+#include <esp_heap_caps.h>
+#include <lauxlib.h>
+#include "event.h"
+#include "bench.h"
+
+// Number of times every defined name is looked up per measurement.
+#define FIND_ROUNDS 100
+
+// Number of messages that are sent before the queues are emptied, and number
+// of times this is done per measurement.
+#define FANOUT_BATCH 8
+#define FANOUT_ROUNDS 50
+
+// Number of latency probes per measurement, and number of slow events that
+// are queued before every probe when flooding.
+#define LANES_PROBES 20
+#define LANES_FLOOD 24
+
+// Number of events that are sent and received per throughput measurement.
+#define QUEUE_ROUNDS 1000
+
+// Number of events that are passed to Lua per delivery measurement.
+#define DELIVERY_ROUNDS 1000
+
+static int bench_find(lua_State *L);
+static int bench_fanout(lua_State *L);
+static int bench_lanes(lua_State *L);
+static int bench_queues(lua_State *L);
+static int bench_delivery(lua_State *L);
+
+// Keep the compiler from optimizing the measured work away.
+static volatile int sink;
+
+void bench_register(lua_State *L)
+{
+	lua_createtable(L, 0, 5);
+	lua_pushliteral(L, "find");
+	lua_pushcfunction(L, &bench_find);
+	lua_settable(L, -3);
+	lua_pushliteral(L, "fanout");
+	lua_pushcfunction(L, &bench_fanout);
+	lua_settable(L, -3);
+	lua_pushliteral(L, "lanes");
+	lua_pushcfunction(L, &bench_lanes);
+	lua_settable(L, -3);
+	lua_pushliteral(L, "queues");
+	lua_pushcfunction(L, &bench_queues);
+	lua_settable(L, -3);
+	lua_pushliteral(L, "delivery");
+	lua_pushcfunction(L, &bench_delivery);
+	lua_settable(L, -3);
+	lua_setglobal(L, "bench");
+}
+
+// This is how event_find used to work, for comparison.
+static int linear_find(const EventType *defs, int num, const char *name)
+{
+	int event;
+	for (event = 1; event <= num; ++event) {
+		if (defs[event].name == NULL)
+			continue;
+		if (strcmp(defs[event].name, name) == 0)
+			return event;
+	}
+	return 0;
+}
+
+// Time looking up every name (and one missing name) FIND_ROUNDS times.
+// Returns nanoseconds per lookup.
+static int time_find(const EventType *defs, const uint8_t *index, int num,
+	bool hashed)
+{
+	int64_t start = esp_timer_get_time();
+	int round;
+	for (round = 0; round < FIND_ROUNDS; ++round) {
+		int event;
+		for (event = 1; event <= num; ++event) {
+			const char *name = defs[event].name;
+			if (hashed)
+				sink = event_index_find(index, defs, name, event_hash(name));
+			else
+				sink = linear_find(defs, num, name);
+		}
+		if (hashed)
+			sink = event_index_find(index, defs, "missing",
+				event_hash("missing"));
+		else
+			sink = linear_find(defs, num, "missing");
+	}
+	int64_t elapsed = esp_timer_get_time() - start;
+	return (int)(elapsed * 1000 / (FIND_ROUNDS * (num + 1)));
+}
+
+static int bench_find(lua_State *L)
+{
+	// Use a private registry, so the real one is not filled with junk.
+	static const int sizes[] = { 10, 50, 100 };
+	const int max_size = 100;
+	EventType *defs = calloc(max_size + 1, sizeof(EventType));
+	uint8_t *index = calloc(EVENT_INDEX_SIZE, 1);
+	char (*names)[16] = calloc(max_size + 1, sizeof(*names));
+	if (defs == NULL || index == NULL || names == NULL) {
+		printf(_("Unable to allocate find benchmark\n"));
+		free(defs);
+		free(index);
+		free(names);
+		lua_settop(L, 0);
+		return 0;
+	}
+	printf(_("Events  linear (ns)  hashed (ns)\n"));
+	int num = 0;
+	size_t s;
+	for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+		// Extend the registry to the next size.
+		for (; num < sizes[s]; ++num) {
+			int event = num + 1;
+			snprintf(names[event], sizeof(names[event]), "bench_%d", event);
+			defs[event].name = names[event];
+			defs[event].hash = event_hash(names[event]);
+			event_index_add(index, defs, event);
+		}
+		int linear = time_find(defs, index, num, false);
+		int hashed = time_find(defs, index, num, true);
+		printf("%6d  %11d  %11d\n", num, linear, hashed);
+	}
+	free(defs);
+	free(index);
+	free(names);
+	lua_settop(L, 0);
+	return 0;
+}
+
+// Find or define an event with one string parameter.
+static int bench_event(const char *name)
+{
+	static const char *none[6] = { NULL, };
+	static const char *str[3] = { "str", NULL, NULL };
+	int eventcode = event_find(name);
+	if (eventcode == 0)
+		eventcode = event_new(name, none, none, str, 0);
+	return eventcode;
+}
+
+// Time sending FANOUT_ROUNDS * FANOUT_BATCH messages to num queues, and
+// receiving them. Without multicast, every queue has claimed its own event
+// and the message is copied for each of them; this is how startup.lua used to
+// send debug messages to every browser. Returns nanoseconds per message.
+static int time_fanout(const int *resend, int multicast, EventQueue *queues,
+	int num, bool use_multicast)
+{
+	static const char message[] = "Fan-out benchmark message";
+	int64_t start = esp_timer_get_time();
+	int round;
+	for (round = 0; round < FANOUT_ROUNDS; ++round) {
+		int m;
+		for (m = 0; m < FANOUT_BATCH; ++m) {
+			if (use_multicast) {
+				Event event = { .eventcode = multicast, };
+				event.s[0] = event_strdup(message, sizeof(message) - 1);
+				event_send(&event);
+				continue;
+			}
+			int q;
+			for (q = 0; q < num; ++q) {
+				Event event = { .eventcode = resend[q], };
+				event.s[0] = event_strdup(message, sizeof(message) - 1);
+				event_send(&event);
+			}
+		}
+		int q;
+		for (q = 0; q < num; ++q) {
+			Event event;
+			while (event_wait(0, &event, queues[q])) {
+				sink = event.s[0][0];
+				event_free(&event);
+			}
+		}
+	}
+	int64_t elapsed = esp_timer_get_time() - start;
+	return (int)(elapsed * 1000 / (FANOUT_ROUNDS * FANOUT_BATCH));
+}
+
+static int bench_fanout(lua_State *L)
+{
+	lua_settop(L, 0);
+	// These events stay defined, so running the benchmark again reuses them.
+	int multicast = bench_event("bench_multicast");
+	int resend[MAX_SUBSCRIBERS];
+	EventQueue queues[MAX_SUBSCRIBERS];
+	int q;
+	for (q = 0; q < MAX_SUBSCRIBERS; ++q) {
+		char name[20];
+		snprintf(name, sizeof(name), "bench_resend%d", q);
+		resend[q] = bench_event(name);
+		queues[q] = event_queue_create(FANOUT_BATCH);
+		if (multicast == 0 || resend[q] == 0 || queues[q] == NULL) {
+			printf(_("Unable to set up fan-out benchmark\n"));
+			for (; q >= 0; --q) {
+				if (queues[q] != NULL)
+					event_queue_delete(queues[q]);
+			}
+			return 0;
+		}
+	}
+	printf(_("Queues  resend (ns)  multicast (ns)\n"));
+	int num;
+	for (num = 1; num <= MAX_SUBSCRIBERS; ++num) {
+		// Add one receiver to both setups.
+		event_claim(resend[num - 1], EVENT_DELIVER_RAW,
+			queues[num - 1]);
+		event_subscribe(multicast, EVENT_DELIVER_RAW,
+			queues[num - 1]);
+		int copied = time_fanout(resend, multicast, queues, num, false);
+		int shared = time_fanout(resend, multicast, queues, num, true);
+		printf("%6d  %11d  %14d\n", num, copied, shared);
+	}
+	for (q = 0; q < MAX_SUBSCRIBERS; ++q) {
+		event_release(resend[q]);
+		event_unsubscribe(multicast, queues[q]);
+		event_queue_delete(queues[q]);
+	}
+	return 0;
+}
+
+// Measure the time from sending get_pin to receiving its reply, which is
+// handled in the same (high priority) lane as motor and pwm events. If flood
+// is set, LANES_FLOOD LED refreshes (and I2C reads, if i2c_target is not
+// negative) are queued before every probe. Results are in microseconds.
+static void time_lanes(EventQueue queue, int reply, bool flood,
+	int i2c_target, int *max, int *average)
+{
+	int get_pin = event_find("get_pin");
+	int set_led = event_find("set_LED");
+	int i2c_read = event_find("i2c_read");
+	int64_t total = 0;
+	*max = 0;
+	int probe;
+	for (probe = 0; probe < LANES_PROBES; ++probe) {
+		int f;
+		for (f = 0; flood && f < LANES_FLOOD; ++f) {
+			Event event = { .eventcode = set_led, };
+			event.i[0] = -1;	// Only refresh the LEDs.
+			event_send(&event);
+			if (i2c_target >= 0) {
+				Event read = { .eventcode = i2c_read, };
+				read.i[0] = i2c_target;
+				read.i[1] = -1;	// No reply.
+				event_send(&read);
+			}
+		}
+		Event event = { .eventcode = get_pin, };
+		event.i[0] = 0;
+		event.i[1] = reply;
+		int64_t start = esp_timer_get_time();
+		event_send(&event);
+		if (!event_wait(1000, &event, queue)) {
+			printf(_("No reply from get_pin\n"));
+			continue;
+		}
+		int latency = (int)(esp_timer_get_time() - start);
+		total += latency;
+		if (latency > *max)
+			*max = latency;
+		// Let the flood drain before the next probe.
+		vTaskDelay(100 / portTICK_PERIOD_MS);
+	}
+	*average = (int)(total / LANES_PROBES);
+}
+
+static int bench_lanes(lua_State *L)
+{
+	// An I2C read target (as used for i2c_read) can be passed to include I2C
+	// transactions in the flood. It must refer to a registered device.
+	int i2c_target = -1;
+	if (lua_gettop(L) >= 1 && lua_isinteger(L, 1))
+		i2c_target = lua_tointeger(L, 1);
+	lua_settop(L, 0);
+	static const char *value[6] = { "value", NULL, };
+	static const char *none[3] = { NULL, };
+	int reply = event_find("bench_pin");
+	if (reply == 0)
+		reply = event_new("bench_pin", value, none, none, 0);
+	EventQueue queue = event_queue_create(LANES_PROBES);
+	if (reply == 0 || queue == NULL ||
+		!event_claim(reply, EVENT_DELIVER_RAW, queue)) {
+		printf(_("Unable to set up lanes benchmark\n"));
+		if (queue != NULL)
+			event_queue_delete(queue);
+		return 0;
+	}
+	printf(_("Flood  max (us)  average (us)\n"));
+	int max, average;
+	time_lanes(queue, reply, false, i2c_target, &max, &average);
+	printf("%5d  %8d  %12d\n", 0, max, average);
+	time_lanes(queue, reply, true, i2c_target, &max, &average);
+	printf("%5d  %8d  %12d\n", LANES_FLOOD, max, average);
+	event_release(reply);
+	event_queue_delete(queue);
+	return 0;
+}
+
+// Heap memory that is used by a queue for length events. If compact is false,
+// this is a FreeRTOS queue of full events, which is what was used before event
+// queues existed.
+static int queue_ram(int length, bool compact)
+{
+	size_t before = heap_caps_get_free_size(MALLOC_CAP_DEFAULT);
+	size_t after;
+	if (compact) {
+		EventQueue queue = event_queue_create(length);
+		after = heap_caps_get_free_size(MALLOC_CAP_DEFAULT);
+		event_queue_delete(queue);
+	} else {
+		QueueHandle_t queue = xQueueCreate(length, sizeof(Event));
+		after = heap_caps_get_free_size(MALLOC_CAP_DEFAULT);
+		vQueueDelete(queue);
+	}
+	return (int)(before - after);
+}
+
+// Time sending and receiving QUEUE_ROUNDS copies of an event. Returns
+// nanoseconds per event.
+static int time_queue(int eventcode, bool compact)
+{
+	Event event = { .eventcode = eventcode, .i = { 1, 2, 3, 4, 5, 6 }, };
+	Event received;
+	int64_t start;
+	int round;
+	if (compact) {
+		EventQueue queue = event_queue_create(10);
+		start = esp_timer_get_time();
+		for (round = 0; round < QUEUE_ROUNDS; ++round) {
+			event_queue_send(queue, &event);
+			event_wait(0, &received, queue);
+		}
+		event_queue_delete(queue);
+	} else {
+		QueueHandle_t queue = xQueueCreate(10, sizeof(Event));
+		start = esp_timer_get_time();
+		for (round = 0; round < QUEUE_ROUNDS; ++round) {
+			xQueueSend(queue, &event, 0);
+			xQueueReceive(queue, &received, 0);
+		}
+		vQueueDelete(queue);
+	}
+	int64_t elapsed = esp_timer_get_time() - start;
+	sink = received.i[0];
+	return (int)(elapsed * 1000 / QUEUE_ROUNDS);
+}
+
+static int bench_queues(lua_State *L)
+{
+	lua_settop(L, 0);
+	static const int lengths[] = { 10, 20, 50 };
+	printf(_("Length  queue (bytes)  event queue (bytes)  saved (bytes)\n"));
+	size_t l;
+	for (l = 0; l < sizeof(lengths) / sizeof(lengths[0]); ++l) {
+		int full = queue_ram(lengths[l], false);
+		int compact = queue_ram(lengths[l], true);
+		printf("%6d  %13d  %19d  %13d\n", lengths[l], full, compact,
+			full - compact);
+	}
+	// Events with 2 and 4 int parameters.
+	static const char *names[] = { "motor", "set_LED" };
+	printf(_("Event    queue (ns)  event queue (ns)\n"));
+	for (l = 0; l < sizeof(names) / sizeof(names[0]); ++l) {
+		int eventcode = event_find(names[l]);
+		if (eventcode == 0)
+			continue;
+		int full = time_queue(eventcode, false);
+		int compact = time_queue(eventcode, true);
+		printf("%-7s  %10d  %16d\n", names[l], full, compact);
+	}
+	return 0;
+}
+
+// Bytes that the Lua state has allocated.
+static int lua_bytes(lua_State *L)
+{
+	return lua_gc(L, LUA_GCCOUNT) * 1024 + lua_gc(L, LUA_GCCOUNTB);
+}
+
+// Pass DELIVERY_ROUNDS events through a queue to a Lua function that reads one
+// parameter, as a script task does. Stores the bytes that Lua allocated per
+// event (with the collector stopped) in garbage, and returns nanoseconds per
+// event (with the collector running, so its work is included).
+static int time_delivery(lua_State *L, int eventcode, EventDelivery delivery,
+	int consumer, int table, int *garbage)
+{
+	EventQueue queue = event_queue_create(4);
+	Event event = { .eventcode = eventcode, .i = { 5, 1 }, };
+	Event received;
+	int pass;
+	int64_t elapsed = 0;
+	for (pass = 0; pass < 2; ++pass) {
+		lua_gc(L, LUA_GCCOLLECT);
+		if (pass == 0)
+			lua_gc(L, LUA_GCSTOP);
+		int before = lua_bytes(L);
+		int64_t start = esp_timer_get_time();
+		int round;
+		for (round = 0; round < DELIVERY_ROUNDS; ++round) {
+			event_queue_send(queue, &event);
+			event_wait(0, &received, queue);
+			lua_rawgeti(L, LUA_REGISTRYINDEX, consumer);
+			int num = event_push(L, &received, delivery, table);
+			event_free(&received);
+			lua_call(L, num, 1);
+			sink = lua_tointeger(L, -1);
+			lua_pop(L, 1);
+		}
+		elapsed = esp_timer_get_time() - start;
+		if (pass == 0) {
+			*garbage = (lua_bytes(L) - before) / DELIVERY_ROUNDS;
+			lua_gc(L, LUA_GCRESTART);
+		}
+	}
+	event_queue_delete(queue);
+	return (int)(elapsed * 1000 / DELIVERY_ROUNDS);
+}
+
+static int bench_delivery(lua_State *L)
+{
+	lua_settop(L, 0);
+	static const char *ints[6] = { "pin", "value", NULL, };
+	static const char *none[3] = { NULL, };
+	int eventcode = event_find("bench_delivery");
+	if (eventcode == 0)
+		eventcode = event_new("bench_delivery", ints, none, none, 0);
+	if (eventcode == 0) {
+		printf(_("Unable to set up delivery benchmark\n"));
+		return 0;
+	}
+	static const char *const modes[] = { "parsed", "raw", "values", "reuse" };
+	// Consumers read the pin, as a script would.
+	static const char *const consumers[] = {
+		"return function(e) return e.pin end",
+		"return function(e) return e[2] end",
+		"return function(code, pin, value) return pin end",
+		"return function(e) return e[2] end",
+	};
+	lua_createtable(L, 4, 1);
+	int table = luaL_ref(L, LUA_REGISTRYINDEX);
+	printf(_("Mode    time (ns)  garbage (bytes)\n"));
+	int mode;
+	for (mode = EVENT_DELIVER_PARSED; mode <= EVENT_DELIVER_REUSE; ++mode) {
+		if (LUA_OK != luaL_loadstring(L, consumers[mode]) ||
+			LUA_OK != lua_pcall(L, 0, 1, 0)) {
+			lua_settop(L, 0);
+			continue;
+		}
+		int consumer = luaL_ref(L, LUA_REGISTRYINDEX);
+		int garbage;
+		int time = time_delivery(L, eventcode, mode, consumer, table,
+			&garbage);
+		luaL_unref(L, LUA_REGISTRYINDEX, consumer);
+		printf("%-6s  %9d  %15d\n", modes[mode], time, garbage);
+	}
+	luaL_unref(L, LUA_REGISTRYINDEX, table);
+	return 0;
+}
+
+#endif
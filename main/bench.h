@@ -0,0 +1,42 @@
+/*
+ * # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # #
+ * #                                                                         #
+ * #                              +@@+    .-++-------=*=.                    #
+ * #                             +%%@+-------------------+                   #
+ * #                            =@@+*=---------------------==                #
+ * #                         .%+-=@%*+=----------------------=*.             #
+ * #                        =%---=@=***-------------------------+.           #
+ * #                       .%----=@%#=+%=------------------------*           #
+ * #                        *+---=@**#%-#=----------+:*------------          #
+ * #                        .#+--=@%%#++++=-------+: :*-----------*          #
+ * #                           +##@%#%%%#=#=----*:..:*------------#.         #
+ * #             **%@@@@@@@#+-.                    -=------------+           #
+ * #       .*@%+.         .                       =------------==            #
+ * #    =@=.....         =@+=%%   +@   --        :*-------------             #
+ * #   @*........                 .#@@@-          +------------=:            #
+ * #   @=.......                                  -+---------------++*.      #
+ * #   *%-...-%@.                     ...         .=------------------:      #
+ * #     -@@=...                                   .+----------------#       #
+ * #        =#@%+-..                               ..+-------------=.        #
+ * #                  .:-=*#%%%@@@:                ...=----------+:  +=+:    #
+ * #                            +%                  ...+---------= .-----:   #
+ * #                           :@.                   ...++--------------+    #
+ * #                           %*                     ....+@%#-----%+        #
+ * #                          :@.                      .....+@:              #
+ * #                                                                         #
+ * # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # #
+ * # NAME       = Event benchmarks                                           #
+ * # PROJECT    = Beursgadget 2025 - Circuit-Cruiser                         #
+ * # DATE       = 17-10-2026                                                 #
+ * # AUTHOR     = Bas Wijnen & Jan-Cees Tjepkema                             #
+ * # WEBSITE    = https://pinkfluffyunicorns.nl                              #
+ * # COPYRIGHT(C) Pink Fluffy Unicorns 2025                                  #
+ * # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # #
+ */
+
+#include <lua.h>
+
+/// @brief Register the benchmark functions in the Lua global "bench".
+/// Benchmarks are only built when CONFIG_EVENT_BENCHMARKS is enabled.
+/// @param L The Lua state to register the functions in.
+void bench_register(lua_State *L);
@@ -35,12 +35,14 @@
  */
 
 #include <stdio.h>
+#include <string.h>
 #include <event.h>
 #include <soc/soc_caps.h>
 #include <driver/uart.h>
 #include <driver/usb_serial_jtag.h>
 #include <driver/usb_serial_jtag_vfs.h>
 #include "cli.h"
+#include "trace.h"
 
 #define LINE_SIZE 500
 
@@ -48,7 +50,7 @@ static void monitor_task(ScriptTask *self)
 {
 	while (true) {
 		Event event;
-		if (!event_wait(-1, &event, self->queue)) {
+		if (!event_task_wait(self, -1, &event)) {
 			// Should not happen.
 			printf(_("cli event timed out?!\n"));
 			continue;
@@ -87,7 +89,7 @@ void cli_task(void * /*arg*/)
 	usb_serial_jtag_driver_install(&usb_serial_jtag_config);
 	usb_serial_jtag_vfs_use_driver();
 
-	ScriptTask *self = create_lua_task();
+	ScriptTask *self = create_lua_task("cli", 0, 0);
 
 	// Use a separate task to monitor incoming events.
 	xTaskCreate((TaskFunction_t)&monitor_task, "cli-monitor", 2048, self,
@@ -117,6 +119,17 @@ void cli_task(void * /*arg*/)
 		}
 		line[p] = '\0';
 		p = 0;
+		// "stats" and "trace" are not valid Lua, so they can be used as
+		// commands.
+		if (strcmp(line, "stats") == 0) {
+			event_print_stats();
+			event_print_tasks();
+			continue;
+		}
+		if (strcmp(line, "trace") == 0) {
+			trace_print();
+			continue;
+		}
 		//printf(_("running command %s\n"), line);
 		run_lua_command(self, line, cli_reply_cb, NULL);
 	}
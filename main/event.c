@@ -35,39 +35,290 @@
  */
 
 #include <string.h>
+#include <stddef.h>
+#include <limits.h>
 #include <math.h>
 #include <stdarg.h>
 #include <lualib.h>
 #include <lauxlib.h>
 #include <esp_rom_crc.h>
+#include <esp_timer.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
 #include "event.h"
 #include "cli.h"
-
-#define QUEUE_LENGTH 10
+#include "bench.h"
+#include "trace.h"
+#include "record.h"
+
+#define QUEUE_LENGTH CONFIG_EVENT_TASK_QUEUE_LENGTH
+
+// Maximum number of different queues that receive events from one batch.
+#define MAX_BATCH_QUEUES 8
+
+// Number of slots in the timing wheel of event_send_at (a power of two), and
+// the time that every slot covers, in microseconds.
+#define WHEEL_SLOTS 64
+#define WHEEL_TICK_US 1000
+
+// Parameters that are stored in an encoded event.
+#define ENCODED_PARAMS 4
+
+// Space that the ring buffer needs for one event with ENCODED_PARAMS
+// parameters. The ring buffer adds an 8 byte header to every item.
+#define EVENT_QUEUE_SLOT (8 + sizeof(EncodedEvent) + \
+	ENCODED_PARAMS * sizeof(EventField))
+
+// Space of the smallest item in a queue: an event without parameters.
+#define EVENT_QUEUE_MIN_ITEM (8 + sizeof(EncodedEvent))
+
+// Sizes of the event string arena.
+#define ARENA_SMALL_SIZE 32
+#define ARENA_SMALL_BLOCKS 32
+#define ARENA_MEDIUM_SIZE 96
+#define ARENA_MEDIUM_BLOCKS 16
+#define ARENA_LARGE_SIZE 256
+#define ARENA_LARGE_BLOCKS 8
+
+// Results of yielded_delay that are not a timeout.
+#define YIELD_INVALID INT_MIN
+#define YIELD_STUCK (INT_MIN + 1)
+
+// What a script in the Lua executor waits for.
+typedef enum ScriptState {
+	SCRIPT_IDLE,	// Not run by the executor.
+	SCRIPT_START,	// Launched; the file is not loaded yet.
+	SCRIPT_EVENT,	// An event, or the end of its timeout.
+	SCRIPT_REPLY,	// The reply to event.call, or the end of its timeout.
+	SCRIPT_STUCK,	// Nothing; it cannot continue.
+} ScriptState;
+
+// The state of a filter before and after an event passed it. If the event
+// cannot be delivered to the claiming queue, the change is undone.
+typedef struct FilterUndo {
+	bool active;	// The filter state was changed by the event.
+	EventFilter before;
+	EventFilter after;
+} FilterUndo;
 
 static int run_lua(ScriptTask *self, int nargs, int *num_returns);
 static void reply_lua_value(lua_State *L, int i);
 static void print_lua_stack(lua_State *L);
+#ifdef CONFIG_EVENT_LUA_EXECUTOR
+static bool executor_init();
+static bool executor_add(ScriptTask *self);
+static void executor_remove(ScriptTask *self);
+static void executor_task(void *arg);
+#else
 static void script_task(void *arg);
-static void handle_raw_event(ScriptTask *self);
-static void handle_parsed_event(ScriptTask *self);
+#endif
+static size_t encode_event(const Event *event, void *buffer);
+static size_t encoded_size(const Event *event);
+static void decode_event(const void *buffer, Event *event);
+static bool marshal_event(lua_State *L, int idx, Event *event);
+static bool marshal_raw_event(lua_State *L, int idx, Event *event);
+static bool marshal_parsed_event(lua_State *L, int idx, Event *event);
 static int event_lua_claim(lua_State *L);
 static int event_lua_release(lua_State *L);
+static int event_lua_subscribe(lua_State *L);
+static int event_lua_unsubscribe(lua_State *L);
 static int event_lua_find(lua_State *L);
 static int event_lua_get_name(lua_State *L);
 static int event_lua_new(lua_State *L);
+static int event_lua_delete(lua_State *L);
 static int event_lua_send(lua_State *L);
+static int event_lua_send_many(lua_State *L);
 static int event_lua_launch(lua_State *L);
+static int event_lua_tasks(lua_State *L);
+static int event_lua_coalesced(lua_State *L);
+static int event_lua_dropped(lua_State *L);
+static int event_lua_arena(lua_State *L);
+static int event_lua_stats(lua_State *L);
+static void push_stats(lua_State *L, const EventStats *stats);
+static void update_max(unsigned *max, unsigned value);
+static void record_latency(LatencyHistogram *histogram, uint32_t latency);
+static void push_histogram(lua_State *L, const LatencyHistogram *histogram);
+static void print_histogram(const char *stage,
+	const LatencyHistogram *histogram);
+static int event_lua_now(lua_State *L);
+static int event_lua_timer(lua_State *L);
+static void timer_callback(void *arg);
+static bool set_timer(EventType *def, int eventcode, uint64_t period,
+	bool oneshot, EventQueue owner);
+static void stop_timers(EventQueue owner);
+static void unschedule(EventQueue owner, int eventcode);
+static bool wheel_init();
+static void wheel_callback(void *arg);
+static void wheel_task(void *arg);
+static int event_lua_send_at(lua_State *L);
+static int event_lua_send_after(lua_State *L);
+static int event_lua_call(lua_State *L);
+static int event_lua_on(lua_State *L);
+static int event_lua_record(lua_State *L);
+static int event_lua_record_stop(lua_State *L);
+static int event_lua_replay(lua_State *L);
+static bool run_handler(ScriptTask *self, Event *event);
+static int push_reply(lua_State *L, Event *reply);
+static int wait_reply(ScriptTask *self, lua_State *L);
+static void string_free(const char *str);
+static void string_ref(const char *str, int count);
+static void share_strings(const Event *event, int count);
+static unsigned parse_event_flags(lua_State *L, int idx);
+static EventType *get_def(int eventcode);
+static bool remove_subscriber(EventType *def, EventQueue queue);
+static void clear_filter(EventType *def);
+static void registry_sync();
+static int event_receivers(const EventType *def, EventQueue *queues);
+static int filter_receivers(EventType *def, const Event *event,
+	EventQueue *queues, int num, FilterUndo *undo);
+static bool filter_passes(EventFilter *filter, const Event *event);
+static void filter_rollback(EventType *def, const FilterUndo *undo);
+static bool parse_filter(lua_State *L, int idx, const EventType *def,
+	EventFilter *filter);
+static bool parse_delivery(lua_State *L, int idx, EventDelivery *delivery);
+static bool send_event(const Event *event, int timeout, bool keep);
+static bool deliver(EventType *def, EventQueue queue, Event *event,
+	TickType_t wait);
+static bool send_coalesced(EventType *def, EventQueue queue, Event *event,
+	TickType_t wait);
+static bool queue_send(EventType *def, EventQueue queue, const Event *event,
+	TickType_t wait);
+static void collect_coalesced(Event *event, EventQueue queue);
+static void drop_mailboxes(EventQueue queue);
+static void drop_event_mailboxes(int index);
+static void unpublish_event(EventType *def);
+static void free_event(EventType *def);
 static bool fill_names(lua_State *L, int idx, const char *names[], int size);
 static int cleanup(lua_State *L, const char *i[6], const char *f[3],
 	const char *s[3]);
 static inline void dump_event(int eventcode);
+static char *format_event(const EventType *def, const Event *event);
 
 static lua_State *main_lua_state;
 static ScriptTask tasks[MAX_TASKS];
 static ScriptTask *current_lua_thread;
 static ScriptTask *startup_task;
+static int reply_eventcode;	// Event for replies to event.call.
+static int event_key;	// Ref of the interned string "event".
+static int time_key;	// Ref of the interned string "t".
 static int max_event;	// Maximum event that has been defined, plus 1.
+// Entries of event_defs below max_event that were deleted, to be used again.
+static uint8_t free_events[MAX_EVENTS];
+static int num_free_events;
+
+// The registry (event_defs and max_event) is read without locks: by senders on
+// both cores and in interrupts. Writers are serialized by registry_lock; they
+// publish definitions, claims and subscriptions with atomic stores. A queue
+// that is removed is only deleted after registry_sync, so senders never use a
+// deleted queue.
+static SemaphoreHandle_t registry_lock;
+static unsigned registry_epoch;	// Incremented by registry_sync.
+static unsigned registry_readers[2];	// Senders by parity of their epoch.
+static uint8_t name_index[EVENT_INDEX_SIZE];	// Event codes by name hash.
+
+// Event as it is stored in an EventQueue: a header with the number of
+// parameters of each type, followed by the source time and the call id (if
+// they are set), the ints, floats and strings.
+typedef union EventField {
+	int i;
+	float f;
+	const char *s;
+	uint32_t t;
+} EventField;
+
+typedef struct EncodedEvent {
+	uint16_t eventcode;
+	uint8_t num_int: 3, num_float: 2, num_str: 2;
+	uint8_t more: 1, timed: 1, called: 1;
+	uint32_t queued;	// Low bits of esp_timer_get_time() when it was queued.
+	EventField param[];
+} EncodedEvent;
+
+// Pending value of a coalesced event. The queue only holds a token for it.
+typedef struct Mailbox {
+	int eventcode;	// 0 if the mailbox is not in use.
+	int key;	// First int parameter for EVENT_COALESCE_KEY, otherwise 0.
+	EventQueue queue;	// Every receiver has its own mailbox.
+	uint32_t serial;	// Changed by every value that is put in it.
+	bool queued;	// A token for it is in the queue, or being sent.
+	Event event;
+} Mailbox;
+
+static Mailbox mailboxes[MAX_MAILBOXES];
+static uint32_t mailbox_serial;	// Last serial that was given to a value.
+static portMUX_TYPE mailbox_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// Protects the state of event filters, which are also used from interrupts.
+static portMUX_TYPE filter_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// Timer that sends an event.
+typedef struct EventTimer {
+	esp_timer_handle_t handle;	// NULL if the timer is not in use.
+	int eventcode;
+	EventQueue owner;
+} EventTimer;
+
+static EventTimer timers[MAX_TIMERS];
+// Protects timers; they are set from Lua tasks on both cores.
+static SemaphoreHandle_t timer_lock;
+
+// Event that is waiting in the timing wheel.
+typedef struct Scheduled {
+	Event event;
+	EventQueue owner;	// Queue of the task that scheduled it, or NULL.
+	uint32_t rounds;	// Number of turns of the wheel before it is due.
+	int next;	// Next entry in the slot or in the free list; -1 at the end.
+} Scheduled;
+
+static Scheduled scheduled[MAX_SCHEDULED];
+static int wheel_head[WHEEL_SLOTS];	// First entry of every slot, or -1.
+static int wheel_tail[WHEEL_SLOTS];	// Last entry of every slot.
+static int free_scheduled;	// First unused entry, or -1.
+static int num_scheduled;	// Number of entries in the wheel.
+static int64_t wheel_tick;	// Last tick that was handled.
+static TaskHandle_t wheel_handle;
+// Wakes up the wheel task every tick, while events are scheduled.
+static esp_timer_handle_t wheel_timer;
+// Protects the wheel. This is a mutex rather than a critical section, because
+// the timer is started and stopped while it is held.
+static SemaphoreHandle_t wheel_lock;
+
+// String parameters of events are stored in fixed size blocks. Blocks are
+// claimed and released with atomic operations on a bitmap, so this can be
+// used from any task without locking. A block is shared by all receivers of
+// an event; it is released when its reference count drops to zero.
+typedef struct ArenaClass {
+	size_t size;	// Size of one block.
+	int blocks;	// Number of blocks; at most 32.
+	char *data;
+	uint32_t *refs;	// Reference count of every block.
+	uint32_t used;	// Bitmap of blocks that are in use.
+	int in_use;
+	int high_water;
+} ArenaClass;
+
+static char arena_small[ARENA_SMALL_BLOCKS][ARENA_SMALL_SIZE];
+static char arena_medium[ARENA_MEDIUM_BLOCKS][ARENA_MEDIUM_SIZE];
+static char arena_large[ARENA_LARGE_BLOCKS][ARENA_LARGE_SIZE];
+static uint32_t refs_small[ARENA_SMALL_BLOCKS];
+static uint32_t refs_medium[ARENA_MEDIUM_BLOCKS];
+static uint32_t refs_large[ARENA_LARGE_BLOCKS];
+static ArenaClass arena[EVENT_ARENA_CLASSES] = {
+	{ ARENA_SMALL_SIZE, ARENA_SMALL_BLOCKS, &arena_small[0][0], refs_small,
+		0, 0, 0 },
+	{ ARENA_MEDIUM_SIZE, ARENA_MEDIUM_BLOCKS, &arena_medium[0][0], refs_medium,
+		0, 0, 0 },
+	{ ARENA_LARGE_SIZE, ARENA_LARGE_BLOCKS, &arena_large[0][0], refs_large,
+		0, 0, 0 },
+};
+static unsigned arena_heap_strings;	// Strings that did not fit.
+
+// Strings that do not fit in the arena are stored on the heap, after their
+// reference count.
+typedef struct HeapString {
+	uint32_t refs;
+	char data[];
+} HeapString;
 
 static char reply_buffer[REPLY_BUFFER_SIZE + 1];	// Add one for nul byte.
 static size_t reply_size = 0;
@@ -128,21 +379,40 @@ static int compute_crc(lua_State *L)
 bool event_init()
 {
 	print_dir("/");
+	registry_lock = xSemaphoreCreateMutex();
+	if (registry_lock == NULL)
+		return false;
+	timer_lock = xSemaphoreCreateMutex();
+	if (timer_lock == NULL)
+		return false;
 	max_event = 1;
+	num_free_events = 0;
 	memset(event_defs, 0, sizeof(event_defs));
+	memset(name_index, 0, sizeof(name_index));
+	memset(mailboxes, 0, sizeof(mailboxes));
 	main_lua_state = luaL_newstate();
 	if (main_lua_state == NULL)
 		return false;
 	luaL_openlibs(main_lua_state);
+	lua_pushliteral(main_lua_state, "event");
+	event_key = luaL_ref(main_lua_state, LUA_REGISTRYINDEX);
+	lua_pushliteral(main_lua_state, "t");
+	time_key = luaL_ref(main_lua_state, LUA_REGISTRYINDEX);
 
 	// Set up system globals in lua.
-	lua_createtable(main_lua_state, 0, 7);
+	lua_createtable(main_lua_state, 0, 25);
 	lua_pushliteral(main_lua_state, "claim");
 	lua_pushcfunction(main_lua_state, &event_lua_claim);
 	lua_settable(main_lua_state, -3);
 	lua_pushliteral(main_lua_state, "release");
 	lua_pushcfunction(main_lua_state, &event_lua_release);
 	lua_settable(main_lua_state, -3);
+	lua_pushliteral(main_lua_state, "subscribe");
+	lua_pushcfunction(main_lua_state, &event_lua_subscribe);
+	lua_settable(main_lua_state, -3);
+	lua_pushliteral(main_lua_state, "unsubscribe");
+	lua_pushcfunction(main_lua_state, &event_lua_unsubscribe);
+	lua_settable(main_lua_state, -3);
 	lua_pushliteral(main_lua_state, "find");
 	lua_pushcfunction(main_lua_state, &event_lua_find);
 	lua_settable(main_lua_state, -3);
@@ -152,12 +422,60 @@ bool event_init()
 	lua_pushliteral(main_lua_state, "new");
 	lua_pushcfunction(main_lua_state, &event_lua_new);
 	lua_settable(main_lua_state, -3);
+	lua_pushliteral(main_lua_state, "delete");
+	lua_pushcfunction(main_lua_state, &event_lua_delete);
+	lua_settable(main_lua_state, -3);
 	lua_pushliteral(main_lua_state, "send");
 	lua_pushcfunction(main_lua_state, &event_lua_send);
 	lua_settable(main_lua_state, -3);
+	lua_pushliteral(main_lua_state, "send_many");
+	lua_pushcfunction(main_lua_state, &event_lua_send_many);
+	lua_settable(main_lua_state, -3);
+	lua_pushliteral(main_lua_state, "on");
+	lua_pushcfunction(main_lua_state, &event_lua_on);
+	lua_settable(main_lua_state, -3);
+	lua_pushliteral(main_lua_state, "call");
+	lua_pushcfunction(main_lua_state, &event_lua_call);
+	lua_settable(main_lua_state, -3);
+	lua_pushliteral(main_lua_state, "send_at");
+	lua_pushcfunction(main_lua_state, &event_lua_send_at);
+	lua_settable(main_lua_state, -3);
+	lua_pushliteral(main_lua_state, "send_after");
+	lua_pushcfunction(main_lua_state, &event_lua_send_after);
+	lua_settable(main_lua_state, -3);
 	lua_pushliteral(main_lua_state, "launch");
 	lua_pushcfunction(main_lua_state, &event_lua_launch);
 	lua_settable(main_lua_state, -3);
+	lua_pushliteral(main_lua_state, "tasks");
+	lua_pushcfunction(main_lua_state, &event_lua_tasks);
+	lua_settable(main_lua_state, -3);
+	lua_pushliteral(main_lua_state, "coalesced");
+	lua_pushcfunction(main_lua_state, &event_lua_coalesced);
+	lua_settable(main_lua_state, -3);
+	lua_pushliteral(main_lua_state, "dropped");
+	lua_pushcfunction(main_lua_state, &event_lua_dropped);
+	lua_settable(main_lua_state, -3);
+	lua_pushliteral(main_lua_state, "arena");
+	lua_pushcfunction(main_lua_state, &event_lua_arena);
+	lua_settable(main_lua_state, -3);
+	lua_pushliteral(main_lua_state, "stats");
+	lua_pushcfunction(main_lua_state, &event_lua_stats);
+	lua_settable(main_lua_state, -3);
+	lua_pushliteral(main_lua_state, "now");
+	lua_pushcfunction(main_lua_state, &event_lua_now);
+	lua_settable(main_lua_state, -3);
+	lua_pushliteral(main_lua_state, "timer");
+	lua_pushcfunction(main_lua_state, &event_lua_timer);
+	lua_settable(main_lua_state, -3);
+	lua_pushliteral(main_lua_state, "record");
+	lua_pushcfunction(main_lua_state, &event_lua_record);
+	lua_settable(main_lua_state, -3);
+	lua_pushliteral(main_lua_state, "record_stop");
+	lua_pushcfunction(main_lua_state, &event_lua_record_stop);
+	lua_settable(main_lua_state, -3);
+	lua_pushliteral(main_lua_state, "replay");
+	lua_pushcfunction(main_lua_state, &event_lua_replay);
+	lua_settable(main_lua_state, -3);
 
 	lua_setglobal(main_lua_state, "event");
 
@@ -165,7 +483,32 @@ bool event_init()
 	lua_pushcfunction(main_lua_state, &compute_crc);
 	lua_setglobal(main_lua_state, "crc");
 
-	startup_task = launch_lua_task("startup.lua");
+#ifdef CONFIG_EVENT_BENCHMARKS
+	bench_register(main_lua_state);
+#endif
+
+	// Replies to event.call. Their values are returned, so the names are not
+	// used.
+	reply_eventcode = event_new("reply", (const char *[6]) {
+		"v1", "v2", "v3", "v4", "v5", "v6"
+	}, (const char *[3]) { NULL, NULL, NULL },
+		(const char *[3]) { NULL, NULL, NULL }, 0);
+	if (reply_eventcode == 0)
+		return false;
+
+	if (!wheel_init()) {
+		printf(_("Unable to start event timing wheel\n"));
+		return false;
+	}
+
+#ifdef CONFIG_EVENT_LUA_EXECUTOR
+	if (!executor_init()) {
+		printf(_("Unable to start Lua executor\n"));
+		return false;
+	}
+#endif
+
+	startup_task = launch_lua_task("startup.lua", 0, 0);
 
 	return startup_task != NULL;
 }
@@ -179,67 +522,334 @@ bool event_start()
 		return false;
 
 	Event event = { 0, };
-	if (pdTRUE != xQueueSend(startup_task->queue, &event, 0))
+	if (!event_queue_send(startup_task->queue, &event))
 		return false;
 
 	return true;
 }
 
-bool event_claim(int eventcode, bool raw, QueueHandle_t queue)
+// Set how the Lua task that owns the queue receives an event, if it is one.
+static void set_delivery(int eventcode, EventDelivery delivery,
+	EventQueue queue)
+{
+	int task;
+	for (task = 0; task < MAX_TASKS; ++task) {
+		ScriptTask *self = &tasks[task];
+		if (self->active && (self->queue == queue ||
+			(self->urgent != NULL && self->urgent == queue)))
+			self->delivery[EVENT_INDEX(eventcode)] = delivery;
+	}
+}
+
+bool event_claim(int eventcode, EventDelivery delivery, EventQueue queue)
+{
+	EventType *def = get_def(eventcode);
+	if (def == NULL)
+		return false;
+	xSemaphoreTake(registry_lock, portMAX_DELAY);
+	bool ok = def->queue == NULL;
+	if (ok) {
+		set_delivery(eventcode, delivery, queue);
+		// Senders read the queue without the lock.
+		__atomic_store_n(&def->queue, queue, __ATOMIC_RELEASE);
+	}
+	xSemaphoreGive(registry_lock);
+	return ok;
+}
+
+bool event_release(int eventcode)
 {
-	if (eventcode < 1 || eventcode >= max_event)
+	EventType *def = get_def(eventcode);
+	if (def == NULL)
 		return false;
-	EventType *def = &event_defs[eventcode];
-	if (def->name == NULL || def->queue != NULL)
+	xSemaphoreTake(registry_lock, portMAX_DELAY);
+	bool ok = def->queue != NULL;
+	if (ok) {
+		__atomic_store_n(&def->queue, NULL, __ATOMIC_RELEASE);
+		clear_filter(def);
+	}
+	xSemaphoreGive(registry_lock);
+	return ok;
+}
+
+// Remove the filter of the claimer, when it releases an event.
+static void clear_filter(EventType *def)
+{
+	portENTER_CRITICAL_SAFE(&filter_lock);
+	def->filter.test = EVENT_FILTER_ANY;
+	def->filter.rate = 0;
+	portEXIT_CRITICAL_SAFE(&filter_lock);
+}
+
+bool event_filter(int eventcode, const EventFilter *filter)
+{
+	EventType *def = get_def(eventcode);
+	if (def == NULL || __atomic_load_n(&def->queue, __ATOMIC_ACQUIRE) == NULL)
 		return false;
-	def->queue = queue;
-	def->raw = raw;
+	EventFilter new_filter = { EVENT_FILTER_ANY, };
+	if (filter != NULL) {
+		if (filter->test != EVENT_FILTER_ANY &&
+			(filter->field < 0 || filter->field >= def->num_int))
+			return false;
+		new_filter = *filter;
+		new_filter.seen = false;
+		new_filter.count = 0;
+		new_filter.window = 0;
+	}
+	portENTER_CRITICAL_SAFE(&filter_lock);
+	def->filter = new_filter;
+	portEXIT_CRITICAL_SAFE(&filter_lock);
 	return true;
 }
 
-bool event_release(int eventcode)
+bool event_subscribe(int eventcode, EventDelivery delivery, EventQueue queue)
 {
-	if (eventcode < 1 || eventcode >= max_event)
+	EventType *def = get_def(eventcode);
+	if (def == NULL || queue == NULL)
 		return false;
-	EventType *def = &event_defs[eventcode];
-	if (def->name == NULL || def->queue == NULL)
+	xSemaphoreTake(registry_lock, portMAX_DELAY);
+	EventQueue *slot = NULL;
+	int s;
+	for (s = 0; s < MAX_SUBSCRIBERS; ++s) {
+		if (def->subscribers[s] == queue) {
+			xSemaphoreGive(registry_lock);
+			return true;	// Already subscribed.
+		}
+		if (def->subscribers[s] == NULL && slot == NULL)
+			slot = &def->subscribers[s];
+	}
+	if (slot != NULL) {
+		set_delivery(eventcode, delivery, queue);
+		__atomic_store_n(slot, queue, __ATOMIC_RELEASE);
+	}
+	xSemaphoreGive(registry_lock);
+	if (slot == NULL) {
+		printf(_("Too many subscribers for event %s\n"), def->name);
 		return false;
-	def->queue = NULL;
+	}
 	return true;
 }
 
-int event_find(const char *name)
+bool event_unsubscribe(int eventcode, EventQueue queue)
+{
+	EventType *def = get_def(eventcode);
+	if (def == NULL || queue == NULL)
+		return false;
+	xSemaphoreTake(registry_lock, portMAX_DELAY);
+	bool found = remove_subscriber(def, queue);
+	xSemaphoreGive(registry_lock);
+	return found;
+}
+
+// Remove a queue from the subscribers of an event. Must be called with
+// registry_lock held.
+static bool remove_subscriber(EventType *def, EventQueue queue)
+{
+	int s;
+	for (s = 0; s < MAX_SUBSCRIBERS; ++s) {
+		if (def->subscribers[s] == queue) {
+			__atomic_store_n(&def->subscribers[s], NULL, __ATOMIC_RELEASE);
+			return true;
+		}
+	}
+	return false;
+}
+
+// Return the definition of an event, or NULL if it is not defined or the code
+// is of a deleted event. The definition is completely initialized before
+// max_event or its name is published, so this does not need a lock, and can
+// be used from interrupts and both cores.
+static EventType *get_def(int eventcode)
+{
+	int index = EVENT_INDEX(eventcode);
+	if (index < 1 || index >= __atomic_load_n(&max_event, __ATOMIC_ACQUIRE))
+		return NULL;
+	EventType *def = &event_defs[index];
+	if (__atomic_load_n(&def->name, __ATOMIC_ACQUIRE) == NULL ||
+		eventcode != EVENT_CODE(index,
+			__atomic_load_n(&def->generation, __ATOMIC_ACQUIRE)))
+		return NULL;
+	return def;
+}
+
+// Start using queues from the registry. Senders are not blocked; the count
+// only tells destroy_lua_task when a removed queue can no longer be in use.
+// Returns the epoch, for event_registry_exit.
+unsigned event_registry_enter()
+{
+	while (true) {
+		unsigned epoch = __atomic_load_n(&registry_epoch, __ATOMIC_SEQ_CST);
+		__atomic_add_fetch(&registry_readers[epoch & 1], 1, __ATOMIC_SEQ_CST);
+		// If the epoch changed in between, registry_sync may not wait for
+		// this sender, so count it in the new epoch instead.
+		if (__atomic_load_n(&registry_epoch, __ATOMIC_SEQ_CST) == epoch)
+			return epoch;
+		__atomic_sub_fetch(&registry_readers[epoch & 1], 1, __ATOMIC_SEQ_CST);
+	}
+}
+
+void event_registry_exit(unsigned epoch)
+{
+	__atomic_sub_fetch(&registry_readers[epoch & 1], 1, __ATOMIC_SEQ_CST);
+}
+
+// Wait until all senders that may have seen queues which were removed from
+// the registry are done. Senders that start later cannot see them. Must be
+// called with registry_lock held, after the queues were removed.
+static void registry_sync()
 {
-	int event;
-	for (event = 1; event < max_event; ++event) {
-		const char *event_name = event_defs[event].name;
-		if (event_name == NULL)
+	unsigned epoch = __atomic_fetch_add(&registry_epoch, 1, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n(&registry_readers[epoch & 1], __ATOMIC_SEQ_CST) != 0)
+		vTaskDelay(1);
+}
+
+uint32_t event_hash(const char *name)
+{
+	// FNV-1a.
+	uint32_t hash = 2166136261u;
+	for (; *name != '\0'; ++name) {
+		hash ^= (uint8_t)*name;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+int event_index_find(const uint8_t *index, const EventType *defs,
+	const char *name, uint32_t hash)
+{
+	// Open addressing with linear probing; an empty slot ends the search.
+	uint32_t slot;
+	uint32_t n;
+	for (slot = hash, n = 0; n < EVENT_INDEX_SIZE; ++slot, ++n) {
+		int event = __atomic_load_n(&index[slot & (EVENT_INDEX_SIZE - 1)],
+			__ATOMIC_ACQUIRE);
+		if (event == 0)
+			return 0;
+		// Deleted entries keep the probe sequences of later ones intact.
+		if (event == EVENT_INDEX_DELETED)
 			continue;
-		if (strcmp(event_name, name) == 0)
+		const EventType *def = &defs[event];
+		if (def->hash == hash && strcmp(def->name, name) == 0)
 			return event;
 	}
 	return 0;
 }
 
+bool event_index_add(uint8_t *index, const EventType *defs, int eventcode)
+{
+	const EventType *def = &defs[eventcode];
+	uint8_t *free_entry = NULL;
+	uint32_t slot;
+	uint32_t n;
+	for (slot = def->hash, n = 0; n < EVENT_INDEX_SIZE; ++slot, ++n) {
+		uint8_t *entry = &index[slot & (EVENT_INDEX_SIZE - 1)];
+		if (*entry == EVENT_INDEX_DELETED) {
+			// The name may still follow; keep looking, but use this entry.
+			if (free_entry == NULL)
+				free_entry = entry;
+			continue;
+		}
+		if (*entry == 0) {
+			if (free_entry == NULL)
+				free_entry = entry;
+			break;
+		}
+		const EventType *other = &defs[*entry];
+		if (other->hash == def->hash && strcmp(other->name, def->name) == 0) {
+			// Name is already defined; lookups return the first definition.
+			return true;
+		}
+	}
+	if (free_entry == NULL)
+		return false;
+	// Lookups do not take a lock.
+	__atomic_store_n(free_entry, eventcode, __ATOMIC_RELEASE);
+	return true;
+}
+
+void event_index_remove(uint8_t *index, const EventType *defs, int eventcode)
+{
+	const EventType *def = &defs[eventcode];
+	uint32_t slot;
+	uint32_t n;
+	for (slot = def->hash, n = 0; n < EVENT_INDEX_SIZE; ++slot, ++n) {
+		uint8_t *entry = &index[slot & (EVENT_INDEX_SIZE - 1)];
+		if (*entry == 0)
+			return;
+		if (*entry == eventcode) {
+			__atomic_store_n(entry, EVENT_INDEX_DELETED, __ATOMIC_RELEASE);
+			return;
+		}
+	}
+}
+
+int event_find(const char *name)
+{
+	if (name == NULL)
+		return 0;
+	// The names of deleted events are freed after registry_sync.
+	unsigned epoch = event_registry_enter();
+	int index = event_index_find(name_index, event_defs, name,
+		event_hash(name));
+	int eventcode = index == 0 ? 0 : event_code_at(index);
+	event_registry_exit(epoch);
+	return eventcode;
+}
+
 const char *event_get_name(int eventcode)
 {
-	if (eventcode < 1 || eventcode >= max_event)
-		return NULL;
-	return event_defs[eventcode].name;
+	EventType *def = get_def(eventcode);
+	return def == NULL ? NULL : def->name;
+}
+
+int event_code_at(int index)
+{
+	if (index < 1 || index >= __atomic_load_n(&max_event, __ATOMIC_ACQUIRE))
+		return 0;
+	EventType *def = &event_defs[index];
+	if (__atomic_load_n(&def->name, __ATOMIC_ACQUIRE) == NULL)
+		return 0;
+	return EVENT_CODE(index,
+		__atomic_load_n(&def->generation, __ATOMIC_ACQUIRE));
 }
 
 int event_new(const char *name, const char *i[6], const char *f[3],
-	const char *s[3])
+	const char *s[3], unsigned flags)
 {
-	if (max_event >= MAX_EVENTS)
+	xSemaphoreTake(registry_lock, portMAX_DELAY);
+	// The index only holds one definition per name; a second one could not
+	// be found, and deleting the first would hide it.
+	if (event_index_find(name_index, event_defs, name, event_hash(name))
+		!= 0) {
+		printf(_("Event %s is already defined\n"), name);
+		xSemaphoreGive(registry_lock);
+		return 0;
+	}
+	// Entries of deleted events are used first.
+	bool recycled = num_free_events > 0;
+	int index = recycled ? free_events[num_free_events - 1] : max_event;
+	if (index >= MAX_EVENTS) {
+		xSemaphoreGive(registry_lock);
+		return 0;
+	}
+	EventType *def = &event_defs[index];
+	char *copy = strdup(name);
+	if (copy == NULL) {
+		xSemaphoreGive(registry_lock);
 		return 0;
-	EventType *def = &event_defs[max_event];
-	def->name = strdup(name);
+	}
+	def->hash = event_hash(copy);
 	def->num_float = 0;
 	def->num_int = 0;
 	def->num_str = 0;
 	def->queue = NULL;
-	def->raw = true;
+	memset(def->subscribers, 0, sizeof(def->subscribers));
+	// Created in Lua context, because other tasks may be using Lua now.
+	def->keys = 0;
+	def->owner = NULL;
+	def->flags = flags;
+	memset(&def->filter, 0, sizeof(def->filter));
+	memset(&def->stats, 0, sizeof(def->stats));
 	int n;
 	for (n = 0; n < 6; ++n) {
 		def->i[n] = i[n];
@@ -254,122 +864,1485 @@ int event_new(const char *name, const char *i[6], const char *f[3],
 		if (s[n] != NULL)
 			def->num_str = n + 1;
 	}
+	if (recycled) {
+		// A code that event_find returned while the event was deleted must
+		// not become valid again, so the generation also changes here.
+		uint8_t generation = def->generation + 1;
+		__atomic_store_n(&def->generation, generation == 0 ? 1 : generation,
+			__ATOMIC_RELEASE);
+	}
+	// The name is published before the index refers to it; get_def does not
+	// accept the code before max_event includes it, or the code is returned.
+	__atomic_store_n(&def->name, copy, __ATOMIC_RELEASE);
+	if (!event_index_add(name_index, event_defs, index)) {
+		printf(_("Event name index is full\n"));
+		__atomic_store_n(&def->name, NULL, __ATOMIC_RELEASE);
+		free(copy);
+		xSemaphoreGive(registry_lock);
+		return 0;
+	}
 	//printf(_("created event\n"));
-	//dump_event(max_event);
-	return max_event++;
+	//dump_event(index);
+	// Publish the definition only now that it is complete. A lookup by name
+	// can find it slightly earlier, but get_def rejects it until then.
+	if (recycled)
+		--num_free_events;
+	else
+		__atomic_store_n(&max_event, index + 1, __ATOMIC_RELEASE);
+	int eventcode = EVENT_CODE(index, def->generation);
+	xSemaphoreGive(registry_lock);
+	return eventcode;
+}
+
+bool event_delete(int eventcode)
+{
+	xSemaphoreTake(registry_lock, portMAX_DELAY);
+	EventType *def = get_def(eventcode);
+	// Events of C code are never deleted; drivers keep their codes.
+	if (def == NULL || def->owner == NULL) {
+		xSemaphoreGive(registry_lock);
+		return false;
+	}
+	event_timer(eventcode, 0, false, NULL);
+	unschedule(NULL, eventcode);
+	unpublish_event(def);
+	registry_sync();
+	free_event(def);
+	xSemaphoreGive(registry_lock);
+	return true;
+}
+
+// Make the code of an event invalid and remove its receivers. Must be called
+// with registry_lock held, followed by registry_sync and free_event.
+static void unpublish_event(EventType *def)
+{
+	int index = def - event_defs;
+	event_index_remove(name_index, event_defs, index);
+	uint8_t generation = def->generation + 1;
+	__atomic_store_n(&def->generation, generation == 0 ? 1 : generation,
+		__ATOMIC_RELEASE);
+	__atomic_store_n(&def->queue, NULL, __ATOMIC_RELEASE);
+	clear_filter(def);
+	int s;
+	for (s = 0; s < MAX_SUBSCRIBERS; ++s)
+		__atomic_store_n(&def->subscribers[s], NULL, __ATOMIC_RELEASE);
+}
+
+// Release the memory of an event that was unpublished, and put its entry on
+// the free list. No sender can use it anymore. Must be called with
+// registry_lock held, from a Lua task.
+static void free_event(EventType *def)
+{
+	int index = def - event_defs;
+	drop_event_mailboxes(index);
+	int task;
+	for (task = 0; task < MAX_TASKS; ++task) {
+		ScriptTask *self = &tasks[task];
+		if (self->handlers[index] != 0)
+			luaL_unref(main_lua_state, LUA_REGISTRYINDEX,
+				self->handlers[index]);
+		self->handlers[index] = 0;
+		self->delivery[index] = EVENT_DELIVER_RAW;
+	}
+	if (def->keys != 0)
+		luaL_unref(main_lua_state, LUA_REGISTRYINDEX, def->keys);
+	def->keys = 0;
+	const char *name = def->name;
+	__atomic_store_n(&def->name, NULL, __ATOMIC_RELEASE);
+	free((char *)name);
+	// Parameter names of events that Lua defined were copied by event.new.
+	int n;
+	for (n = 0; n < 6; ++n) {
+		free((char *)def->i[n]);
+		def->i[n] = NULL;
+	}
+	for (n = 0; n < 3; ++n) {
+		free((char *)def->f[n]);
+		def->f[n] = NULL;
+		free((char *)def->s[n]);
+		def->s[n] = NULL;
+	}
+	def->owner = NULL;
+	free_events[num_free_events++] = index;
 }
 
 bool event_send(const Event *event)
 {
-	if (event->eventcode >= 1 && event->eventcode < max_event) {
-		EventType *def = &event_defs[event->eventcode];
+	return send_event(event, 0, false);
+}
+
+bool event_try_send(const Event *event)
+{
+	return send_event(event, 0, true);
+}
+
+bool event_send_timeout(const Event *event, int timeout)
+{
+	return send_event(event, timeout, true);
+}
+
+// Deliver an event to all receivers, waiting at most timeout ms in total for
+// room in their queues. If keep is set and the event is not delivered, it is
+// not freed.
+static bool send_event(const Event *event, int timeout, bool keep)
+{
+	EventQueue queues[1 + MAX_SUBSCRIBERS];
+	int num = 0;
+	bool filtered = false;
+	FilterUndo undo = { .active = false };
+	unsigned epoch = event_registry_enter();
+	EventType *def = get_def(event->eventcode);
+	if (def != NULL) {
 		//printf("Sending event %s, queue %p\n", def->name, def->queue);
-		if (def->name != NULL && def->queue != NULL) {
-			if (pdTRUE == xQueueSend(def->queue, event, 0))
-				return true;
-		}
+		num = event_receivers(def, queues);
+		int unfiltered = num;
+		num = filter_receivers(def, event, queues, num, &undo);
+		filtered = num < unfiltered;
+		__atomic_add_fetch(&def->stats.sent, 1, __ATOMIC_RELAXED);
+		record_event(event);
 	}
-	event_free((Event *)event);
-	return false;
+	if (num == 0) {
+		event_registry_exit(epoch);
+		trace_record(TRACE_SEND, event->eventcode, 0);
+		// An event that the filter rejected was handled as requested, so it
+		// is not kept.
+		if (!keep || filtered)
+			event_free((Event *)event);
+		return filtered;
+	}
+	// When keeping the event, the sender holds on to its own reference until
+	// it is known whether anything was delivered.
+	share_strings(event, keep ? num : num - 1);
+	TickType_t wait = timeout / portTICK_PERIOD_MS;
+	TickType_t start = xTaskGetTickCount();
+	int sent = 0;
+	int q;
+	for (q = 0; q < num; ++q) {
+		TickType_t elapsed = xTaskGetTickCount() - start;
+		Event copy = *event;
+		copy.more = false;
+		if (deliver(def, queues[q], &copy, elapsed < wait ? wait - elapsed : 0))
+			++sent;
+		else if (q == 0)
+			filter_rollback(def, &undo);
+	}
+	event_registry_exit(epoch);
+	trace_record(TRACE_SEND, event->eventcode, sent);
+	if (keep && sent) {
+		Event copy = *event;
+		event_free(&copy);
+	}
+	return sent;
 }
 
-bool event_wait(int timeout, Event *event, QueueHandle_t queue)
+bool event_send_batch(Event *events, int num)
 {
-	TickType_t delay;
-	if (timeout < 0)
-		delay = portMAX_DELAY;
-	else
-		delay = timeout / portTICK_PERIOD_MS;
-	return pdTRUE == xQueueReceive(queue, event, delay);
+	// Receiving queues of the batch, with the number of events for each and
+	// the last event that it receives.
+	EventQueue batch_queues[MAX_BATCH_QUEUES];
+	int needed[MAX_BATCH_QUEUES];
+	int last[MAX_BATCH_QUEUES];
+	int num_queues = 0;
+	bool ok = num <= MAX_BATCH;
+	// The receivers must stay the same while the batch is planned and sent.
+	unsigned epoch = event_registry_enter();
+	int e;
+	for (e = 0; ok && e < num; ++e) {
+		EventQueue queues[1 + MAX_SUBSCRIBERS];
+		int count = 0;
+		int code = events[e].eventcode;
+		EventType *def = get_def(code);
+		if (def != NULL)
+			count = event_receivers(def, queues);
+		if (count == 0) {
+			printf(_("Batch contains event %d without receivers\n"), code);
+			ok = false;
+		}
+		int q;
+		for (q = 0; ok && q < count; ++q) {
+			int b;
+			for (b = 0; b < num_queues; ++b) {
+				if (batch_queues[b] == queues[q])
+					break;
+			}
+			if (b == num_queues) {
+				if (num_queues == MAX_BATCH_QUEUES) {
+					printf(_("Batch has too many receivers\n"));
+					ok = false;
+					break;
+				}
+				batch_queues[num_queues] = queues[q];
+				needed[num_queues++] = 0;
+			}
+			// Every item in the ring buffer has an 8 byte header.
+			needed[b] += 8 + encoded_size(&events[e]);
+			last[b] = e;
+		}
+	}
+	int b;
+	for (b = 0; ok && b < num_queues; ++b) {
+		if (xRingbufferGetCurFreeSize(batch_queues[b]) < needed[b])
+			ok = false;
+	}
+	if (!ok) {
+		event_registry_exit(epoch);
+		for (e = 0; e < num; ++e)
+			event_free(&events[e]);
+		return false;
+	}
+	// There is room for everything, so nothing is dropped below unless other
+	// tasks fill the same queues at the same time.
+	for (e = 0; e < num; ++e) {
+		EventType *def = &event_defs[EVENT_INDEX(events[e].eventcode)];
+		EventQueue queues[1 + MAX_SUBSCRIBERS];
+		int count = event_receivers(def, queues);
+		__atomic_add_fetch(&def->stats.sent, 1, __ATOMIC_RELAXED);
+		record_event(&events[e]);
+		share_strings(&events[e], count - 1);
+		int sent = 0;
+		int q;
+		for (q = 0; q < count; ++q) {
+			Event copy = events[e];
+			for (b = 0; b < num_queues && batch_queues[b] != queues[q]; ++b) {}
+			if (b == num_queues) {
+				// Subscribed while the batch was planned.
+				event_free(&copy);
+				continue;
+			}
+			copy.more = last[b] != e;
+			if (deliver(def, queues[q], &copy, 0))
+				++sent;
+		}
+		trace_record(TRACE_SEND, events[e].eventcode, sent);
+	}
+	event_registry_exit(epoch);
+	return true;
 }
 
-bool event_free(Event *event)
+// Every receiver owns a reference to the strings, and frees it when it is done
+// with the event. The sender's reference is passed to the first one; this adds
+// count references for the others.
+static void share_strings(const Event *event, int count)
 {
 	int s;
 	for (s = 0; s < 3; ++s) {
 		if (event->s[s] != NULL)
-			free((char *)event->s[s]);
+			string_ref(event->s[s], count);
 	}
-	return true;
 }
 
-ScriptTask *create_lua_task()
+// Fill queues with the claiming queue and all subscribers of an event.
+// Returns the number of queues.
+static int event_receivers(const EventType *def, EventQueue *queues)
 {
-	int task;
-	for (task = 0; task < MAX_TASKS; ++task) {
-		if (!tasks[task].active)
-			break;
-	}
-	if (task >= MAX_TASKS) {
-		// Creation failed.
-		printf(_("Unable to create Lua task\n"));
-		return NULL;
+	int num = 0;
+	EventQueue claimed = __atomic_load_n(&def->queue, __ATOMIC_ACQUIRE);
+	if (claimed != NULL)
+		queues[num++] = claimed;
+	int s;
+	for (s = 0; s < MAX_SUBSCRIBERS; ++s) {
+		EventQueue queue = __atomic_load_n(&def->subscribers[s],
+			__ATOMIC_ACQUIRE);
+		if (queue != NULL && queue != claimed)
+			queues[num++] = queue;
 	}
-	ScriptTask *self = &tasks[task];
-	self->active = true;
-	self->queue = xQueueCreate(QUEUE_LENGTH, sizeof(Event));
-	self->thread = lua_newthread(main_lua_state);
-	self->ref = luaL_ref(main_lua_state, LUA_REGISTRYINDEX);
-	return self;
+	return num;
 }
 
-char *destroy_lua_task(ScriptTask *self)
+// Remove the claiming queue from the receivers of an event if its filter does
+// not pass it. Returns the new number of queues. If the filter passes it and
+// its state changed, undo is set so that filter_rollback can revert that when
+// the event is not delivered to the claiming queue.
+static int filter_receivers(EventType *def, const Event *event,
+	EventQueue *queues, int num, FilterUndo *undo)
 {
-	if (self == NULL)
-		return _("Attempt to destroy NULL script task.\n");
-	if (self == startup_task)
-		startup_task = NULL;
-	self->active = false;
-	luaL_unref(self->thread, LUA_REGISTRYINDEX, self->ref);
-	lua_closethread(self->thread, NULL);
-	size_t q;
-	for (q = 0; q < max_event; ++q) {
-		if (event_defs[q].queue == self->queue)
-			event_defs[q].queue = NULL;
+	// The claiming queue is always the first; it may have been released or
+	// claimed by another queue since the receivers were read.
+	if (num == 0 || queues[0] != __atomic_load_n(&def->queue,
+		__ATOMIC_ACQUIRE) || (def->filter.test == EVENT_FILTER_ANY &&
+		def->filter.rate == 0))
+		return num;
+	portENTER_CRITICAL_SAFE(&filter_lock);
+	undo->before = def->filter;
+	bool pass = filter_passes(&def->filter, event);
+	undo->after = def->filter;
+	portEXIT_CRITICAL_SAFE(&filter_lock);
+	if (pass) {
+		undo->active = true;
+		return num;
 	}
-	vQueueDelete(self->queue);
-	return NULL;
+	__atomic_add_fetch(&def->stats.filtered, 1, __ATOMIC_RELAXED);
+	int q;
+	for (q = 1; q < num; ++q)
+		queues[q - 1] = queues[q];
+	return num - 1;
 }
 
-ScriptTask *launch_lua_task(const char *lua_file)
+// Evaluate a filter, and update its state if the event passes.
+// Must be called with filter_lock held.
+static bool filter_passes(EventFilter *filter, const Event *event)
 {
-	//printf(_("launching lua task %s\n"), lua_file);
-	ScriptTask *self = create_lua_task();
-	if (self == NULL) {
-		printf(_("Failed to launch %s\n"), lua_file);
-		return NULL;
+	int value = event->i[filter->field];
+	switch (filter->test) {
+	case EVENT_FILTER_ANY:
+		break;
+	case EVENT_FILTER_EQUAL:
+		if (value != filter->value)
+			return false;
+		break;
+	case EVENT_FILTER_DIFFERENT:
+		if (value == filter->value)
+			return false;
+		break;
+	case EVENT_FILTER_CHANGED:
+		if (filter->seen && value == filter->last)
+			return false;
+		break;
 	}
-	if (asprintf(&self->lua_file, "/www/lua/%s", lua_file) < 0) {
-		printf(_("Failed to allocate lua filename for launch\n"));
-		destroy_lua_task(self);
-		return NULL;
+	if (filter->rate != 0) {
+		uint32_t now = event_now();
+		if (filter->count == 0 || now - filter->window >= 1000000) {
+			filter->window = now;
+			filter->count = 0;
+		}
+		if (filter->count >= filter->rate)
+			return false;
+		++filter->count;
 	}
-	xTaskCreate(&script_task, lua_file, TASK_STACK_SIZE, self, 0, NULL);
-	return self;
+	// Only values that are delivered count as seen, so a change that was
+	// rejected because of the rate is delivered later.
+	filter->seen = true;
+	filter->last = value;
+	return true;
 }
 
-bool set_lua_constants(const char *tablename, const char **names)
+// Undo the change that an event made to the state of a filter, because it was
+// dropped. If another event or a new filter changed the state since, that
+// change stays.
+static void filter_rollback(EventType *def, const FilterUndo *undo)
 {
-	int num;
-	const char **name;
-	for (num = 0, name = names; *name != NULL; ++num, ++name) {}
-	lua_createtable(main_lua_state, 0, num);
-	int n;
-	for (n = 0; n < num; ++n) {
-		lua_pushstring(main_lua_state, names[n]);
-		lua_pushinteger(main_lua_state, n);
-		lua_rawset(main_lua_state, -3);
+	if (!undo->active)
+		return;
+	portENTER_CRITICAL_SAFE(&filter_lock);
+	EventFilter *filter = &def->filter;
+	if (filter->test == undo->after.test && filter->rate == undo->after.rate &&
+		filter->seen == undo->after.seen && filter->last == undo->after.last &&
+		filter->window == undo->after.window &&
+		filter->count == undo->after.count) {
+		filter->seen = undo->before.seen;
+		filter->last = undo->before.last;
+		filter->window = undo->before.window;
+		filter->count = undo->before.count;
 	}
-	lua_setglobal(main_lua_state, tablename);
-	return true;
+	portEXIT_CRITICAL_SAFE(&filter_lock);
 }
 
-void set_wifi_info(const char *ssid, const char *password)
+// Send one reference of an event to a queue, waiting at most wait ticks for
+// room. On failure, the reference is freed.
+static bool deliver(EventType *def, EventQueue queue, Event *event,
+	TickType_t wait)
 {
-	lua_createtable(main_lua_state, 0, 2);
+	bool sent;
+	if (def->flags & (EVENT_COALESCE | EVENT_COALESCE_KEY))
+		sent = send_coalesced(def, queue, event, wait);
+	else {
+		sent = queue_send(def, queue, event, wait);
+		if (!sent)
+			event_free(event);
+	}
+	if (sent)
+		__atomic_add_fetch(&def->stats.delivered, 1, __ATOMIC_RELAXED);
+	else {
+		__atomic_add_fetch(&def->stats.dropped, 1, __ATOMIC_RELAXED);
+		trace_record(TRACE_DROP, event->eventcode, 0);
+	}
+	return sent;
+}
 
-	lua_pushstring(main_lua_state, "ssid");
-	lua_pushstring(main_lua_state, ssid);
+// Put an event in a queue. If it is full, wait at most wait ticks for room.
+static bool queue_send(EventType *def, EventQueue queue, const Event *event,
+	TickType_t wait)
+{
+	bool sent = event_queue_send(queue, event);
+	if (!sent && wait != 0) {
+		__atomic_add_fetch(&def->stats.retried, 1, __ATOMIC_RELAXED);
+		void *item;
+		if (pdTRUE == xRingbufferSendAcquire(queue, &item, encoded_size(event),
+			wait)) {
+			encode_event(event, item);
+			xRingbufferSendComplete(queue, item);
+			sent = true;
+		}
+	}
+	if (sent) {
+		UBaseType_t items;
+		vRingbufferGetInfo(queue, NULL, NULL, NULL, NULL, &items);
+		update_max(&def->stats.max_depth, items);
+	}
+	return sent;
+}
+
+bool event_send_from_isr(const Event *event)
+{
+	unsigned epoch = event_registry_enter();
+	EventType *def = get_def(event->eventcode);
+	if (def == NULL) {
+		event_registry_exit(epoch);
+		return false;
+	}
+	__atomic_add_fetch(&def->stats.sent, 1, __ATOMIC_RELAXED);
+	record_event(event);
+	EventQueue queues[1 + MAX_SUBSCRIBERS];
+	FilterUndo undo = { .active = false };
+	int num = event_receivers(def, queues);
+	num = filter_receivers(def, event, queues, num, &undo);
+	EventField buffer[sizeof(EncodedEvent) / sizeof(EventField) + 12];
+	size_t size = encode_event(event, buffer);
+	int sent = 0;
+	int q;
+	for (q = 0; q < num; ++q) {
+		if (pdTRUE == xRingbufferSendFromISR(queues[q], buffer, size, NULL)) {
+			__atomic_add_fetch(&def->stats.delivered, 1, __ATOMIC_RELAXED);
+			++sent;
+		}
+		else {
+			__atomic_add_fetch(&def->stats.dropped, 1, __ATOMIC_RELAXED);
+			if (q == 0)
+				filter_rollback(def, &undo);
+		}
+	}
+	event_registry_exit(epoch);
+	trace_record(TRACE_ISR, event->eventcode, sent);
+	return sent > 0;
+}
+
+bool event_timer(int eventcode, uint64_t period, bool oneshot,
+	EventQueue owner)
+{
+	EventType *def = get_def(eventcode);
+	if (def == NULL) {
+		printf(_("Invalid event %d for timer\n"), eventcode);
+		return false;
+	}
+	xSemaphoreTake(timer_lock, portMAX_DELAY);
+	bool ok = set_timer(def, eventcode, period, oneshot, owner);
+	xSemaphoreGive(timer_lock);
+	return ok;
+}
+
+// Set, change or stop the timer of an event. Must be called with timer_lock
+// held.
+static bool set_timer(EventType *def, int eventcode, uint64_t period,
+	bool oneshot, EventQueue owner)
+{
+	EventTimer *timer = NULL;
+	EventTimer *unused = NULL;
+	int n;
+	for (n = 0; n < MAX_TIMERS; ++n) {
+		if (timers[n].handle == NULL) {
+			if (unused == NULL)
+				unused = &timers[n];
+		} else if (timers[n].eventcode == eventcode) {
+			timer = &timers[n];
+			break;
+		}
+	}
+	if (timer != NULL) {
+		esp_timer_stop(timer->handle);
+		if (period == 0) {
+			esp_timer_delete(timer->handle);
+			timer->handle = NULL;
+			return true;
+		}
+	} else {
+		if (period == 0)
+			return true;
+		if (unused == NULL) {
+			printf(_("No timer available for event %s\n"),
+				def->name);
+			return false;
+		}
+		timer = unused;
+		esp_timer_create_args_t args = {
+			.callback = &timer_callback,
+			.arg = timer,
+			.dispatch_method = ESP_TIMER_TASK,
+			.name = def->name,
+		};
+		if (ESP_OK != esp_timer_create(&args, &timer->handle)) {
+			printf(_("Unable to create timer for event %s\n"),
+				def->name);
+			timer->handle = NULL;
+			return false;
+		}
+		timer->eventcode = eventcode;
+	}
+	timer->owner = owner;
+	esp_err_t err = oneshot ? esp_timer_start_once(timer->handle, period) :
+		esp_timer_start_periodic(timer->handle, period);
+	if (err != ESP_OK) {
+		printf(_("Unable to start timer for event %s\n"),
+			def->name);
+		esp_timer_delete(timer->handle);
+		timer->handle = NULL;
+		return false;
+	}
+	return true;
+}
+
+// Runs in the esp_timer task.
+static void timer_callback(void *arg)
+{
+	const EventTimer *timer = arg;
+	Event event = { .eventcode = timer->eventcode, .t = event_now(), };
+	event_send(&event);
+}
+
+static void stop_timers(EventQueue owner)
+{
+	xSemaphoreTake(timer_lock, portMAX_DELAY);
+	int n;
+	for (n = 0; n < MAX_TIMERS; ++n) {
+		EventTimer *timer = &timers[n];
+		if (timer->handle == NULL || timer->owner != owner)
+			continue;
+		esp_timer_stop(timer->handle);
+		esp_timer_delete(timer->handle);
+		timer->handle = NULL;
+	}
+	xSemaphoreGive(timer_lock);
+}
+
+static bool wheel_init()
+{
+	int n;
+	for (n = 0; n < WHEEL_SLOTS; ++n)
+		wheel_head[n] = -1;
+	for (n = 0; n < MAX_SCHEDULED; ++n)
+		scheduled[n].next = n + 1 < MAX_SCHEDULED ? n + 1 : -1;
+	free_scheduled = 0;
+	num_scheduled = 0;
+	wheel_lock = xSemaphoreCreateMutex();
+	if (wheel_lock == NULL)
+		return false;
+	esp_timer_create_args_t args = {
+		.callback = &wheel_callback,
+		.dispatch_method = ESP_TIMER_TASK,
+		.name = "event-wheel",
+		.skip_unhandled_events = true,
+	};
+	if (ESP_OK != esp_timer_create(&args, &wheel_timer))
+		return false;
+	// The priority is above that of the Lua tasks, so scheduled events are
+	// not delayed by scripts.
+	return pdPASS == xTaskCreate(&wheel_task, "event-wheel", 4096, NULL, 1,
+		&wheel_handle);
+}
+
+bool event_reply(const Event *request, Event *reply)
+{
+	if (request->call == 0)
+		return event_send(reply);
+	// The low bits of the call id are the index of the calling task, plus 1.
+	int task = (request->call & 0xf) - 1;
+	reply->eventcode = reply_eventcode;
+	reply->call = request->call;
+	if (task < 0 || task >= MAX_TASKS || tasks[task].replies == NULL ||
+		!event_queue_send(tasks[task].replies, reply)) {
+		event_free(reply);
+		return false;
+	}
+	return true;
+}
+
+// Push the values of a reply onto L, which is the thread that made the call,
+// and free it. Returns the number of values.
+static int push_reply(lua_State *L, Event *reply)
+{
+	if (!lua_checkstack(L, 6)) {
+		event_free(reply);
+		return 0;
+	}
+	int n;
+	for (n = 0; n < 6; ++n)
+		lua_pushinteger(L, reply->i[n]);
+	event_free(reply);
+	return 6;
+}
+
+// Wait for the reply to the call that the script made, and push its values
+// onto L. Returns the number of values, which is 0 if the timeout expired.
+static int wait_reply(ScriptTask *self, lua_State *L)
+{
+	uint16_t call = self->call;
+	self->call = 0;
+	TickType_t start = xTaskGetTickCount();
+	while (true) {
+		int timeout = self->call_timeout;
+		if (timeout > 0) {
+			int elapsed = (xTaskGetTickCount() - start) * portTICK_PERIOD_MS;
+			timeout = elapsed < timeout ? timeout - elapsed : 0;
+		}
+		Event reply;
+		if (!event_wait(timeout, &reply, self->replies))
+			return 0;
+		if (reply.call != call) {
+			// Late reply to an earlier call that timed out.
+			event_free(&reply);
+			continue;
+		}
+		return push_reply(L, &reply);
+	}
+}
+
+bool event_send_at(const Event *event, uint32_t time, EventQueue owner)
+{
+	// Times in the past are sent on the next tick.
+	int32_t delay = time - event_now();
+	int64_t due = esp_timer_get_time() + (delay > 0 ? delay : 0);
+	int64_t tick = (due + WHEEL_TICK_US - 1) / WHEEL_TICK_US;
+	xSemaphoreTake(wheel_lock, portMAX_DELAY);
+	int n = free_scheduled;
+	if (n < 0) {
+		xSemaphoreGive(wheel_lock);
+		printf(_("Too many scheduled events\n"));
+		event_free((Event *)event);
+		return false;
+	}
+	if (num_scheduled++ == 0) {
+		// The wheel was idle; start turning it from now.
+		wheel_tick = esp_timer_get_time() / WHEEL_TICK_US;
+		esp_timer_start_periodic(wheel_timer, WHEEL_TICK_US);
+	}
+	if (tick <= wheel_tick)
+		tick = wheel_tick + 1;
+	Scheduled *entry = &scheduled[n];
+	free_scheduled = entry->next;
+	entry->event = *event;
+	entry->event.t = time;
+	entry->owner = owner;
+	entry->rounds = (tick - wheel_tick - 1) / WHEEL_SLOTS;
+	entry->next = -1;
+	int slot = tick & (WHEEL_SLOTS - 1);
+	if (wheel_head[slot] < 0)
+		wheel_head[slot] = n;
+	else
+		scheduled[wheel_tail[slot]].next = n;
+	wheel_tail[slot] = n;
+	xSemaphoreGive(wheel_lock);
+	return true;
+}
+
+// Runs in the esp_timer task.
+static void wheel_callback(void * /*arg*/)
+{
+	xTaskNotifyGive(wheel_handle);
+}
+
+static void wheel_task(void * /*arg*/)
+{
+	while (true) {
+		ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+		int64_t now = esp_timer_get_time() / WHEEL_TICK_US;
+		xSemaphoreTake(wheel_lock, portMAX_DELAY);
+		// If the task was delayed, catch up with all missed ticks.
+		while (wheel_tick < now && num_scheduled > 0) {
+			++wheel_tick;
+			int slot = wheel_tick & (WHEEL_SLOTS - 1);
+			int n = wheel_head[slot];
+			wheel_head[slot] = -1;
+			while (n >= 0) {
+				Scheduled *entry = &scheduled[n];
+				int next = entry->next;
+				if (entry->rounds == 0) {
+					// The code has the generation of the event; if the entry
+					// was deleted and used again, it is not sent.
+					if (event_get_name(entry->event.eventcode) != NULL)
+						event_send(&entry->event);
+					else
+						event_free(&entry->event);
+					entry->next = free_scheduled;
+					free_scheduled = n;
+					--num_scheduled;
+				} else {
+					// Not due yet; keep it in the slot, in the same order.
+					--entry->rounds;
+					entry->next = -1;
+					if (wheel_head[slot] < 0)
+						wheel_head[slot] = n;
+					else
+						scheduled[wheel_tail[slot]].next = n;
+					wheel_tail[slot] = n;
+				}
+				n = next;
+			}
+		}
+		if (num_scheduled == 0)
+			esp_timer_stop(wheel_timer);
+		xSemaphoreGive(wheel_lock);
+	}
+}
+
+// Drop the scheduled events of a task that ends (owner), or of an event that
+// is deleted (eventcode).
+static void unschedule(EventQueue owner, int eventcode)
+{
+	xSemaphoreTake(wheel_lock, portMAX_DELAY);
+	int slot;
+	for (slot = 0; slot < WHEEL_SLOTS; ++slot) {
+		int n = wheel_head[slot];
+		wheel_head[slot] = -1;
+		while (n >= 0) {
+			Scheduled *entry = &scheduled[n];
+			int next = entry->next;
+			if ((owner != NULL && entry->owner == owner) ||
+				(eventcode != 0 && EVENT_INDEX(entry->event.eventcode) ==
+				EVENT_INDEX(eventcode))) {
+				event_free(&entry->event);
+				entry->next = free_scheduled;
+				free_scheduled = n;
+				--num_scheduled;
+			} else {
+				// Keep it, in the same order.
+				entry->next = -1;
+				if (wheel_head[slot] < 0)
+					wheel_head[slot] = n;
+				else
+					scheduled[wheel_tail[slot]].next = n;
+				wheel_tail[slot] = n;
+			}
+			n = next;
+		}
+	}
+	if (num_scheduled == 0)
+		esp_timer_stop(wheel_timer);
+	xSemaphoreGive(wheel_lock);
+}
+
+EventQueue event_queue_create(int length)
+{
+	return xRingbufferCreate(length * EVENT_QUEUE_SLOT, RINGBUF_TYPE_NOSPLIT);
+}
+
+int event_queue_max_items(int length)
+{
+	return length * EVENT_QUEUE_SLOT / EVENT_QUEUE_MIN_ITEM;
+}
+
+void event_queue_delete(EventQueue queue)
+{
+	Event event;
+	while (event_wait(0, &event, queue))
+		event_free(&event);
+	vRingbufferDelete(queue);
+}
+
+bool event_queue_send(EventQueue queue, const Event *event)
+{
+	void *item;
+	size_t size = encoded_size(event);
+	if (pdTRUE != xRingbufferSendAcquire(queue, &item, size, 0))
+		return false;
+	encode_event(event, item);
+	xRingbufferSendComplete(queue, item);
+	return true;
+}
+
+// Number of bytes that encode_event uses for an event.
+static size_t encoded_size(const Event *event)
+{
+	int num = 0;
+	int index = EVENT_INDEX(event->eventcode);
+	if (index >= 1 && index < max_event) {
+		const EventType *def = &event_defs[index];
+		num = def->num_int + def->num_float + def->num_str;
+	}
+	if (event->t != 0)
+		++num;
+	if (event->call != 0)
+		++num;
+	return sizeof(EncodedEvent) + num * sizeof(EventField);
+}
+
+// Store the used parameters of an event in buffer. Returns the number of bytes
+// that were written.
+static size_t encode_event(const Event *event, void *buffer)
+{
+	EncodedEvent *encoded = buffer;
+	encoded->eventcode = event->eventcode;
+	encoded->more = event->more;
+	encoded->timed = event->t != 0;
+	encoded->called = event->call != 0;
+	encoded->queued = esp_timer_get_time();
+	encoded->num_int = 0;
+	encoded->num_float = 0;
+	encoded->num_str = 0;
+	int index = EVENT_INDEX(event->eventcode);
+	if (index >= 1 && index < max_event) {
+		const EventType *def = &event_defs[index];
+		encoded->num_int = def->num_int;
+		encoded->num_float = def->num_float;
+		encoded->num_str = def->num_str;
+	}
+	EventField *param = encoded->param;
+	if (encoded->timed)
+		(param++)->t = event->t;
+	if (encoded->called)
+		(param++)->i = event->call;
+	int n;
+	for (n = 0; n < encoded->num_int; ++n)
+		(param++)->i = event->i[n];
+	for (n = 0; n < encoded->num_float; ++n)
+		(param++)->f = event->f[n];
+	for (n = 0; n < encoded->num_str; ++n)
+		(param++)->s = event->s[n];
+	return (char *)param - (char *)buffer;
+}
+
+static void decode_event(const void *buffer, Event *event)
+{
+	const EncodedEvent *encoded = buffer;
+	const EventField *param = encoded->param;
+	event->eventcode = encoded->eventcode;
+	event->more = encoded->more;
+	event->t = encoded->timed ? (param++)->t : 0;
+	event->call = encoded->called ? (param++)->i : 0;
+	int n;
+	for (n = 0; n < 6; ++n)
+		event->i[n] = n < encoded->num_int ? (param++)->i : 0;
+	for (n = 0; n < 3; ++n)
+		event->f[n] = n < encoded->num_float ? (param++)->f : 0;
+	for (n = 0; n < 3; ++n)
+		event->s[n] = n < encoded->num_str ? (param++)->s : NULL;
+}
+
+static bool send_coalesced(EventType *def, EventQueue queue, Event *event,
+	TickType_t wait)
+{
+	int key = (def->flags & EVENT_COALESCE_KEY) ? event->i[0] : 0;
+	Mailbox *box = NULL;
+	Event old;
+	bool replaced = false;
+	bool send_token = true;
+	uint32_t serial = 0;
+	int m;
+	taskENTER_CRITICAL(&mailbox_lock);
+	for (m = 0; m < MAX_MAILBOXES; ++m) {
+		Mailbox *candidate = &mailboxes[m];
+		if (candidate->eventcode == event->eventcode && candidate->key == key &&
+			candidate->queue == queue) {
+			// A value is pending; replace it. It only needs a token if the
+			// last one could not be queued.
+			old = candidate->event;
+			candidate->event = *event;
+			++def->stats.coalesced;
+			replaced = true;
+			send_token = !candidate->queued;
+			box = candidate;
+			break;
+		}
+		if (candidate->eventcode == 0 && box == NULL)
+			box = candidate;
+	}
+	if (!replaced && box != NULL) {
+		box->eventcode = event->eventcode;
+		box->key = key;
+		box->queue = queue;
+		box->event = *event;
+	}
+	if (box != NULL) {
+		box->queued = true;
+		box->serial = serial = ++mailbox_serial;
+	}
+	taskEXIT_CRITICAL(&mailbox_lock);
+	if (replaced)
+		event_free(&old);
+	if (!send_token)
+		return true;
+	if (box == NULL) {
+		printf(_("No mailbox available for event %s\n"), def->name);
+		event_free(event);
+		return false;
+	}
+	// Queue a token; the receiver takes the newest value from the mailbox.
+	// The mailbox owns the strings, so the token has none of its own.
+	Event token = *event;
+	memset(token.s, 0, sizeof(token.s));
+	if (queue_send(def, queue, &token, wait))
+		return true;
+	// Queue is full; take the value back out, if it is still this one. A
+	// newer value from another sender, who was told that it was sent, stays;
+	// the next send of the event queues a token for it.
+	bool own = false;
+	taskENTER_CRITICAL(&mailbox_lock);
+	if (box->serial == serial) {
+		old = box->event;
+		box->eventcode = 0;
+		own = true;
+	} else if (box->eventcode == event->eventcode && box->key == key &&
+		box->queue == queue) {
+		box->queued = false;
+	}
+	taskEXIT_CRITICAL(&mailbox_lock);
+	if (own)
+		event_free(&old);
+	return false;
+}
+
+static void collect_coalesced(Event *event, EventQueue queue)
+{
+	const EventType *def = &event_defs[EVENT_INDEX(event->eventcode)];
+	int key = (def->flags & EVENT_COALESCE_KEY) ? event->i[0] : 0;
+	int m;
+	taskENTER_CRITICAL(&mailbox_lock);
+	for (m = 0; m < MAX_MAILBOXES; ++m) {
+		Mailbox *box = &mailboxes[m];
+		if (box->eventcode == event->eventcode && box->key == key &&
+			box->queue == queue) {
+			*event = box->event;
+			box->eventcode = 0;
+			break;
+		}
+	}
+	taskEXIT_CRITICAL(&mailbox_lock);
+	// If no mailbox was found, the event was sent directly to the queue (for
+	// example by an interrupt handler) and it is used as is.
+}
+
+static void drop_mailboxes(EventQueue queue)
+{
+	int m;
+	for (m = 0; m < MAX_MAILBOXES; ++m) {
+		Event old;
+		bool drop = false;
+		taskENTER_CRITICAL(&mailbox_lock);
+		Mailbox *box = &mailboxes[m];
+		if (box->eventcode != 0 && box->queue == queue) {
+			old = box->event;
+			box->eventcode = 0;
+			drop = true;
+		}
+		taskEXIT_CRITICAL(&mailbox_lock);
+		if (drop)
+			event_free(&old);
+	}
+}
+
+// Drop the pending values of a deleted event.
+static void drop_event_mailboxes(int index)
+{
+	int m;
+	for (m = 0; m < MAX_MAILBOXES; ++m) {
+		Event old;
+		bool drop = false;
+		taskENTER_CRITICAL(&mailbox_lock);
+		Mailbox *box = &mailboxes[m];
+		if (box->eventcode != 0 && EVENT_INDEX(box->eventcode) == index) {
+			old = box->event;
+			box->eventcode = 0;
+			drop = true;
+		}
+		taskEXIT_CRITICAL(&mailbox_lock);
+		if (drop)
+			event_free(&old);
+	}
+}
+
+bool event_wait(int timeout, Event *event, EventQueue queue)
+{
+	TickType_t delay;
+	if (timeout < 0)
+		delay = portMAX_DELAY;
+	else
+		delay = timeout / portTICK_PERIOD_MS;
+	size_t size;
+	// Only waits that can block are traced; polls would flood the buffer.
+	if (delay != 0)
+		trace_record(TRACE_WAIT, 0, timeout);
+	void *item = xRingbufferReceive(queue, &size, delay);
+	if (item == NULL) {
+		if (delay != 0)
+			trace_record(TRACE_RECEIVE, 0, 0);
+		return false;
+	}
+	decode_event(item, event);
+	uint32_t queued = ((const EncodedEvent *)item)->queued;
+	vRingbufferReturnItem(queue, item);
+	uint32_t latency = (uint32_t)esp_timer_get_time() - queued;
+	trace_record(TRACE_RECEIVE, event->eventcode, latency);
+	if (event->eventcode == 0)
+		return true;
+	EventType *def = get_def(event->eventcode);
+	if (def == NULL) {
+		// The event was deleted while it was queued. Coalesced values were
+		// freed with their mailbox; tokens have no strings of their own.
+		event_free(event);
+		return event_wait(timeout, event, queue);
+	}
+	if (event->t != 0)
+		record_latency(&def->stats.source, queued - event->t);
+	record_latency(&def->stats.queue, latency);
+	if (def->flags & (EVENT_COALESCE | EVENT_COALESCE_KEY))
+		collect_coalesced(event, queue);
+	return true;
+}
+
+// Raise *max to value, if it is larger. Other tasks may do the same.
+static void update_max(unsigned *max, unsigned value)
+{
+	unsigned old = __atomic_load_n(max, __ATOMIC_RELAXED);
+	while (value > old && !__atomic_compare_exchange_n(max, &old, value, true,
+		__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {}
+}
+
+static void record_latency(LatencyHistogram *histogram, uint32_t latency)
+{
+	int bucket = 0;
+	uint32_t limit = 10;
+	while (bucket < EVENT_LATENCY_BUCKETS - 1 && latency >= limit) {
+		++bucket;
+		limit *= 10;
+	}
+	__atomic_add_fetch(&histogram->count[bucket], 1, __ATOMIC_RELAXED);
+	update_max(&histogram->max, latency);
+}
+
+uint32_t event_now()
+{
+	uint32_t now = esp_timer_get_time();
+	// 0 means that the time is not known.
+	return now == 0 ? 1 : now;
+}
+
+void event_handled(const Event *event, uint32_t start)
+{
+	EventType *def = get_def(event->eventcode);
+	if (def == NULL)
+		return;
+	uint32_t now = event_now();
+	trace_record(TRACE_HANDLED, event->eventcode, now - start);
+	record_latency(&def->stats.handler, now - start);
+	if (event->t != 0)
+		record_latency(&def->stats.total, now - event->t);
+}
+
+bool event_get_stats(int eventcode, EventStats *stats)
+{
+	EventType *def = get_def(eventcode);
+	if (def == NULL)
+		return false;
+	*stats = def->stats;
+	return true;
+}
+
+void event_print_stats()
+{
+	printf(_("%-20s %8s %8s %6s %6s %6s %6s %5s\n"), _("event"), _("sent"),
+		_("deliv"), _("drop"), _("retry"), _("coal"), _("filter"),
+		_("depth"));
+	printf(_("  %-18s %8s  latency (<10us..>1s)\n"), _("stage"), _("max us"));
+	int index;
+	for (index = 1; index < max_event; ++index) {
+		EventStats stats;
+		if (!event_get_stats(event_code_at(index), &stats))
+			continue;
+		printf("%-20s %8u %8u %6u %6u %6u %6u %5u\n",
+			event_defs[index].name, stats.sent, stats.delivered,
+			stats.dropped, stats.retried, stats.coalesced, stats.filtered,
+			stats.max_depth);
+		print_histogram(_("source"), &stats.source);
+		print_histogram(_("queue"), &stats.queue);
+		print_histogram(_("handler"), &stats.handler);
+		print_histogram(_("total"), &stats.total);
+	}
+}
+
+// Print one line of event_print_stats, if anything was recorded.
+static void print_histogram(const char *stage,
+	const LatencyHistogram *histogram)
+{
+	unsigned total = 0;
+	int b;
+	for (b = 0; b < EVENT_LATENCY_BUCKETS; ++b)
+		total += histogram->count[b];
+	if (total == 0)
+		return;
+	printf("  %-18s %8u ", stage, histogram->max);
+	for (b = 0; b < EVENT_LATENCY_BUCKETS; ++b)
+		printf(" %u", histogram->count[b]);
+	printf("\n");
+}
+
+bool event_free(Event *event)
+{
+	int s;
+	for (s = 0; s < 3; ++s) {
+		if (event->s[s] != NULL)
+			string_free(event->s[s]);
+		event->s[s] = NULL;
+	}
+	return true;
+}
+
+const char *event_strdup(const char *str, size_t len)
+{
+	int c;
+	for (c = 0; c < EVENT_ARENA_CLASSES; ++c) {
+		ArenaClass *cls = &arena[c];
+		if (len >= cls->size)
+			continue;
+		uint32_t all = cls->blocks == 32 ? ~0u : (1u << cls->blocks) - 1;
+		uint32_t used = __atomic_load_n(&cls->used, __ATOMIC_RELAXED);
+		while ((used & all) != all) {
+			int block = __builtin_ctz(~used & all);
+			if (!__atomic_compare_exchange_n(&cls->used, &used,
+				used | (1u << block), true, __ATOMIC_ACQUIRE,
+				__ATOMIC_RELAXED))
+				continue;	// used has been reloaded; try again.
+			cls->refs[block] = 1;
+			int in_use = __atomic_add_fetch(&cls->in_use, 1, __ATOMIC_RELAXED);
+			int high = __atomic_load_n(&cls->high_water, __ATOMIC_RELAXED);
+			while (in_use > high && !__atomic_compare_exchange_n(
+				&cls->high_water, &high, in_use, true, __ATOMIC_RELAXED,
+				__ATOMIC_RELAXED)) {}
+			char *copy = &cls->data[block * cls->size];
+			memcpy(copy, str, len);
+			copy[len] = '\0';
+			return copy;
+		}
+		// This class is full; try a larger one.
+	}
+	__atomic_add_fetch(&arena_heap_strings, 1, __ATOMIC_RELAXED);
+	HeapString *heap = malloc(sizeof(HeapString) + len + 1);
+	if (heap == NULL)
+		return NULL;
+	heap->refs = 1;
+	memcpy(heap->data, str, len);
+	heap->data[len] = '\0';
+	return heap->data;
+}
+
+// Find the reference count of an event string.
+static uint32_t *string_refs(const char *str, ArenaClass **cls, int *block)
+{
+	int c;
+	for (c = 0; c < EVENT_ARENA_CLASSES; ++c) {
+		ArenaClass *candidate = &arena[c];
+		if (str < candidate->data ||
+			str >= &candidate->data[candidate->blocks * candidate->size])
+			continue;
+		*cls = candidate;
+		*block = (str - candidate->data) / candidate->size;
+		return &candidate->refs[*block];
+	}
+	*cls = NULL;
+	return &((HeapString *)(str - offsetof(HeapString, data)))->refs;
+}
+
+static void string_ref(const char *str, int count)
+{
+	ArenaClass *cls;
+	int block;
+	if (count > 0)
+		__atomic_add_fetch(string_refs(str, &cls, &block), count,
+			__ATOMIC_RELAXED);
+}
+
+static void string_free(const char *str)
+{
+	ArenaClass *cls;
+	int block;
+	uint32_t *refs = string_refs(str, &cls, &block);
+	if (__atomic_sub_fetch(refs, 1, __ATOMIC_ACQ_REL) != 0)
+		return;	// Another receiver still uses it.
+	if (cls == NULL) {
+		free((char *)str - offsetof(HeapString, data));
+		return;
+	}
+	__atomic_sub_fetch(&cls->in_use, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_and(&cls->used, ~(1u << block), __ATOMIC_RELEASE);
+}
+
+unsigned event_arena_stats(ArenaStats stats[EVENT_ARENA_CLASSES])
+{
+	int c;
+	for (c = 0; c < EVENT_ARENA_CLASSES; ++c) {
+		stats[c].size = arena[c].size;
+		stats[c].blocks = arena[c].blocks;
+		stats[c].in_use = __atomic_load_n(&arena[c].in_use, __ATOMIC_RELAXED);
+		stats[c].high_water = __atomic_load_n(&arena[c].high_water,
+			__ATOMIC_RELAXED);
+	}
+	return __atomic_load_n(&arena_heap_strings, __ATOMIC_RELAXED);
+}
+
+ScriptTask *create_lua_task(const char *name, int queue_length,
+	int urgent_length)
+{
+	int task;
+	for (task = 0; task < MAX_TASKS; ++task) {
+		if (!tasks[task].active)
+			break;
+	}
+	if (task >= MAX_TASKS) {
+		// Creation failed.
+		printf(_("Unable to create Lua task\n"));
+		return NULL;
+	}
+	if (queue_length < 0 || queue_length > MAX_QUEUE_LENGTH ||
+		urgent_length < 0 || urgent_length > MAX_QUEUE_LENGTH) {
+		printf(_("Invalid queue length for Lua task %s\n"), name);
+		return NULL;
+	}
+	ScriptTask *self = &tasks[task];
+	self->active = true;
+	self->source_time = 0;
+	self->call = 0;
+	self->command = false;
+	// The reply queue is never deleted, so a late reply to a task that has
+	// ended does not use a deleted queue.
+	if (self->replies == NULL)
+		self->replies = event_queue_create(2);
+	strlcpy(self->name, name, sizeof(self->name));
+	self->queue_length = queue_length > 0 ? queue_length : QUEUE_LENGTH;
+	self->max_depth = 0;
+	self->queue = event_queue_create(self->queue_length);
+	self->urgent_length = urgent_length;
+	self->urgent_max_depth = 0;
+	self->urgent = NULL;
+	self->lanes = NULL;
+	self->state = SCRIPT_IDLE;
+	self->timed = false;
+	if (self->urgent_length > 0)
+		self->urgent = event_queue_create(self->urgent_length);
+	bool ok = self->replies != NULL && self->queue != NULL &&
+		(self->urgent_length == 0 || self->urgent != NULL);
+#ifndef CONFIG_EVENT_LUA_EXECUTOR
+	// Launched scripts wait in the set of the executor instead.
+	if (ok && self->urgent_length > 0) {
+		// Like in the hardware task, the set needs an entry for every event
+		// that can be in the queues.
+		self->lanes = xQueueCreateSet(
+			event_queue_max_items(self->queue_length) +
+			event_queue_max_items(self->urgent_length));
+		ok = self->lanes != NULL;
+		if (ok) {
+			xRingbufferAddToQueueSetRead(self->urgent, self->lanes);
+			xRingbufferAddToQueueSetRead(self->queue, self->lanes);
+		}
+	}
+#endif
+	if (!ok) {
+		// The queues are still empty.
+		printf(_("Not enough memory for the queues of Lua task %s\n"), name);
+		if (self->urgent != NULL)
+			vRingbufferDelete(self->urgent);
+		self->urgent = NULL;
+		if (self->queue != NULL)
+			vRingbufferDelete(self->queue);
+		self->queue = NULL;
+		self->active = false;
+		return NULL;
+	}
+	self->thread = lua_newthread(main_lua_state);
+	self->ref = luaL_ref(main_lua_state, LUA_REGISTRYINDEX);
+	// Handlers run in their own thread, because the script's thread is
+	// suspended in event.wait while they run.
+	self->handler_thread = lua_newthread(main_lua_state);
+	self->handler_ref = luaL_ref(main_lua_state, LUA_REGISTRYINDEX);
+	memset(self->handlers, 0, sizeof(self->handlers));
+	int e;
+	for (e = 0; e < MAX_EVENTS; ++e)
+		self->delivery[e] = EVENT_DELIVER_RAW;
+	lua_createtable(main_lua_state, 4, 1);
+	self->event_table = luaL_ref(main_lua_state, LUA_REGISTRYINDEX);
+	return self;
+}
+
+char *destroy_lua_task(ScriptTask *self)
+{
+	if (self == NULL)
+		return _("Attempt to destroy NULL script task.\n");
+	if (self == startup_task)
+		startup_task = NULL;
+	self->active = false;
+	int e;
+	for (e = 0; e < MAX_EVENTS; ++e) {
+		if (self->handlers[e] != 0)
+			luaL_unref(main_lua_state, LUA_REGISTRYINDEX, self->handlers[e]);
+		self->handlers[e] = 0;
+	}
+	luaL_unref(main_lua_state, LUA_REGISTRYINDEX, self->event_table);
+	luaL_unref(main_lua_state, LUA_REGISTRYINDEX, self->handler_ref);
+	lua_closethread(self->handler_thread, NULL);
+	luaL_unref(self->thread, LUA_REGISTRYINDEX, self->ref);
+	lua_closethread(self->thread, NULL);
+	stop_timers(self->queue);
+	unschedule(self->queue, 0);
+	Event reply;
+	while (event_wait(0, &reply, self->replies))
+		event_free(&reply);
+	xSemaphoreTake(registry_lock, portMAX_DELAY);
+	int q;
+	for (q = 1; q < max_event; ++q) {
+		EventType *def = &event_defs[q];
+		if (def->queue == self->queue ||
+			(self->urgent != NULL && def->queue == self->urgent)) {
+			__atomic_store_n(&def->queue, NULL, __ATOMIC_RELEASE);
+			clear_filter(def);
+		}
+		remove_subscriber(def, self->queue);
+		// Events that the task defined end with it.
+		if (def->name != NULL && def->owner == self) {
+			event_timer(EVENT_CODE(q, def->generation), 0, false, NULL);
+			unschedule(NULL, EVENT_CODE(q, def->generation));
+			unpublish_event(def);
+		}
+	}
+	// Senders that still use the queue finish first. After that, nothing
+	// can add mailboxes for it either.
+	registry_sync();
+	for (q = 1; q < max_event; ++q) {
+		if (event_defs[q].name != NULL && event_defs[q].owner == self)
+			free_event(&event_defs[q]);
+	}
+	xSemaphoreGive(registry_lock);
+	drop_mailboxes(self->queue);
+	if (self->urgent != NULL)
+		drop_mailboxes(self->urgent);
+	if (self->lanes != NULL || self->state != SCRIPT_IDLE) {
+		// Queues can only leave a set when they are empty.
+		Event event;
+		while ((self->urgent != NULL &&
+			event_wait(0, &event, self->urgent)) ||
+			event_wait(0, &event, self->queue))
+			event_free(&event);
+	}
+	if (self->lanes != NULL) {
+		xRingbufferRemoveFromQueueSetRead(self->urgent, self->lanes);
+		xRingbufferRemoveFromQueueSetRead(self->queue, self->lanes);
+		vQueueDelete(self->lanes);
+		self->lanes = NULL;
+	}
+#ifdef CONFIG_EVENT_LUA_EXECUTOR
+	if (self->state != SCRIPT_IDLE)
+		executor_remove(self);
+#endif
+	if (self->urgent != NULL) {
+		event_queue_delete(self->urgent);
+		self->urgent = NULL;
+	}
+	event_queue_delete(self->queue);
+	return NULL;
+}
+
+ScriptTask *launch_lua_task(const char *lua_file, int queue_length,
+	int urgent_length)
+{
+	//printf(_("launching lua task %s\n"), lua_file);
+	ScriptTask *self = create_lua_task(lua_file, queue_length, urgent_length);
+	if (self == NULL) {
+		printf(_("Failed to launch %s\n"), lua_file);
+		return NULL;
+	}
+	if (asprintf(&self->lua_file, "/www/lua/%s", lua_file) < 0) {
+		printf(_("Failed to allocate lua filename for launch\n"));
+		destroy_lua_task(self);
+		return NULL;
+	}
+#ifdef CONFIG_EVENT_LUA_EXECUTOR
+	if (!executor_add(self)) {
+		printf(_("Failed to launch %s\n"), lua_file);
+		free(self->lua_file);
+		self->lua_file = NULL;
+		destroy_lua_task(self);
+		return NULL;
+	}
+#else
+	xTaskCreate(&script_task, lua_file, TASK_STACK_SIZE, self, 0, NULL);
+#endif
+	return self;
+}
+
+// Note the depth of a queue that an event was just received from.
+static void update_depth(EventQueue queue, unsigned *max_depth)
+{
+	// The queue is deepest right before an event is received.
+	UBaseType_t items;
+	vRingbufferGetInfo(queue, NULL, NULL, NULL, NULL, &items);
+	if (items + 1 > *max_depth)
+		*max_depth = items + 1;
+}
+
+bool event_task_wait(ScriptTask *self, int timeout, Event *event)
+{
+	EventQueue queue = self->queue;
+	unsigned *max_depth = &self->max_depth;
+	if (self->lanes == NULL) {
+		if (!event_wait(timeout, event, queue))
+			return false;
+	} else {
+		TickType_t delay = timeout < 0 ? portMAX_DELAY :
+			timeout / portTICK_PERIOD_MS;
+		TickType_t start = xTaskGetTickCount();
+		while (true) {
+			TickType_t elapsed = xTaskGetTickCount() - start;
+			TickType_t wait = delay == portMAX_DELAY ? delay :
+				elapsed < delay ? delay - elapsed : 0;
+			if (xQueueSelectFromSet(self->lanes, wait) == NULL)
+				return false;
+			// The set holds one entry for every queued event. Always take a
+			// pending urgent event first, regardless of which queue was
+			// selected. Both may be empty if events were coalesced.
+			if (event_wait(0, event, self->urgent)) {
+				queue = self->urgent;
+				max_depth = &self->urgent_max_depth;
+				break;
+			}
+			if (event_wait(0, event, self->queue))
+				break;
+		}
+	}
+	update_depth(queue, max_depth);
+	return true;
+}
+
+void event_print_tasks()
+{
+	printf(_("%-16s %6s %6s %6s %6s\n"), _("task"), _("queue"), _("max"),
+		_("urgent"), _("max"));
+	int task;
+	for (task = 0; task < MAX_TASKS; ++task) {
+		ScriptTask *self = &tasks[task];
+		if (!self->active)
+			continue;
+		printf("%-16s %6d %6u %6d %6u\n", self->name, self->queue_length,
+			self->max_depth, self->urgent_length, self->urgent_max_depth);
+	}
+}
+
+bool set_lua_constants(const char *tablename, const char **names)
+{
+	int num;
+	const char **name;
+	for (num = 0, name = names; *name != NULL; ++num, ++name) {}
+	lua_createtable(main_lua_state, 0, num);
+	int n;
+	for (n = 0; n < num; ++n) {
+		lua_pushstring(main_lua_state, names[n]);
+		lua_pushinteger(main_lua_state, n);
+		lua_rawset(main_lua_state, -3);
+	}
+	lua_setglobal(main_lua_state, tablename);
+	return true;
+}
+
+void set_wifi_info(const char *ssid, const char *password)
+{
+	lua_createtable(main_lua_state, 0, 2);
+
+	lua_pushstring(main_lua_state, "ssid");
+	lua_pushstring(main_lua_state, ssid);
 	lua_rawset(main_lua_state, -3);
 
 	lua_pushstring(main_lua_state, "password");
@@ -418,9 +2391,13 @@ bool run_lua_command(ScriptTask *self, const char *command, ReplyCb reply_cb,
 	void *user_data)
 {
 	current_lua_thread = self;
+	// Events that the command sends have it as their source.
+	self->source_time = event_now();
 	if (LUA_OK == luaL_loadstring(self->thread, command)) {
 		int n;
+		self->command = true;
 		int r = run_lua(self, 0, &n);
+		self->command = false;
 		if (reply_cb == 0) {
 			// Discard pending reply.
 			reply_size = 0;
@@ -464,7 +2441,10 @@ bool run_lua_command(ScriptTask *self, const char *command, ReplyCb reply_cb,
 static int run_lua(ScriptTask *self, int nargs, int *num_returns)
 {
 	current_lua_thread = self;
-	return lua_resume(self->thread, NULL, nargs, num_returns);
+	trace_record(TRACE_RESUME, 0, nargs);
+	int r = lua_resume(self->thread, NULL, nargs, num_returns);
+	trace_record(TRACE_YIELD, 0, r);
+	return r;
 }
 
 static void reply_lua_value(lua_State *L, int i)
@@ -538,11 +2518,10 @@ static void print_lua_stack(lua_State *L)
 	}
 }
 
-static void script_task(void *arg)
+// Load the file of a script that was launched. Ends the script if the file
+// cannot be loaded.
+static bool script_load(ScriptTask *self)
 {
-	ScriptTask *self = arg;
-
-	// Load target code.
 	//printf(_("running lua file: %s: %p \n"), self->lua_file, self);
 	if (LUA_OK != luaL_loadfile(self->thread, self->lua_file)) {
 		// Error.
@@ -551,236 +2530,696 @@ static void script_task(void *arg)
 		free(self->lua_file);
 		self->lua_file = NULL;
 		destroy_lua_task(self);
-		vTaskDelete(NULL);
-		return;
+		return false;
 	}
 	free(self->lua_file);
 	self->lua_file = NULL;
+	return true;
+}
+
+// End a script after its thread returned or produced an error.
+static void script_end(ScriptTask *self, int r)
+{
+	// Ignore return value.
+	if (r != LUA_OK) {
+		// Thread returned error.
+		printf(_("Thread returned error: %s\n"),
+			lua_tostring(self->thread, -1));
+		print_lua_stack(self->thread);
+		reply_send(cli_reply_cb, NULL, "");
+	}
+	lua_settop(self->thread, 0);
+	destroy_lua_task(self);
+}
+
+// Get the timeout in ms that the script yielded to event.wait; -1 for none.
+// Returns YIELD_INVALID if the script must be resumed without an event, or
+// YIELD_STUCK if it cannot continue.
+static int yielded_delay(ScriptTask *self, int n)
+{
+	if (n > 1 || (!lua_isinteger(self->thread, -1) &&
+		!lua_isnil(self->thread, -1))) {
+		if (n != 1) {
+			printf(_("%d arguments yielded\n"), n);
+			print_lua_stack(self->thread);
+			reply_send(cli_reply_cb, NULL, "");
+			return YIELD_STUCK;
+		}
+		printf(_("invalid value yielded: must be one integer or nil.\n"));
+		print_lua_stack(self->thread);
+		reply_send(cli_reply_cb, NULL, "");
+		lua_settop(self->thread, 0);
+		return YIELD_INVALID;
+	}
+	int delay = (n < 1 || lua_isnil(self->thread, -1)) ? -1 :
+		lua_tointeger(self->thread, -1);
+	lua_settop(self->thread, 1);
+	return delay;
+}
+
+// Resume the script with an event that it received. Frees the event.
+static int script_event(ScriptTask *self, Event *event, int *n)
+{
+	if (event->eventcode == 0) {
+		// Special case for startup.lua resume after setup.
+		self->source_time = 0;
+		return run_lua(self, 0, n);
+	}
+	uint32_t start = event_now();
+	// Events that are sent in response share the source of this one.
+	self->source_time = event->t;
+	assert(EVENT_INDEX(event->eventcode) >= 1 &&
+		EVENT_INDEX(event->eventcode) < max_event);
+	int num = event_push(self->thread, event,
+		self->delivery[EVENT_INDEX(event->eventcode)], self->event_table);
+	event_free(event);
+	int r = run_lua(self, num, n);
+	event_handled(event, start);
+	return r;
+}
+
+#ifndef CONFIG_EVENT_LUA_EXECUTOR
+static void script_task(void *arg)
+{
+	ScriptTask *self = arg;
+
+	// Load target code.
+	if (!script_load(self)) {
+		vTaskDelete(NULL);
+		return;
+	}
 
 	// Handle script commands.
 	int n;
 	int r = run_lua(self, 0, &n); // Start script.
-	int delay = -1;	// Use endless delay by default.
 	while (true) {
 		if (r != LUA_YIELD) {
-			// Thread returned or produced an error. Ignore return value.
-			if (r != LUA_OK) {
-				// Thread returned error.
-				printf(_("Thread returned error: %s\n"),
-					lua_tostring(self->thread, -1));
-				print_lua_stack(self->thread);
-				reply_send(cli_reply_cb, NULL, "");
-			}
-			lua_settop(self->thread, 0);
-			destroy_lua_task(self);
+			// Thread returned or produced an error.
+			script_end(self, r);
 			vTaskDelete(NULL);
 			return;
 		}
-		if (n > 1 || (!lua_isinteger(self->thread, -1) &&
-			!lua_isnil(self->thread, -1))) {
-			if (n != 1) {
-				printf(_("%d arguments yielded\n"), n);
-				print_lua_stack(self->thread);
-				reply_send(cli_reply_cb, NULL, "");
-				while (true) {}
-			}
-			printf(_("invalid value yielded: must be one integer or nil.\n"));
-			print_lua_stack(self->thread);
-			reply_send(cli_reply_cb, NULL, "");
-			lua_settop(self->thread, 0);
+		if (self->call != 0) {
+			// The script waits for the reply to event.call.
+			int num = wait_reply(self, self->thread);
+			r = run_lua(self, num, &n);
+			continue;
+		}
+		// Thread yielded; respond to it.
+		int delay = yielded_delay(self, n);
+		if (delay == YIELD_STUCK)
+			while (true) {}
+		if (delay == YIELD_INVALID) {
 			r = run_lua(self, 0, &n);
 			continue;
 		}
-		// Thread yielded or returned a value; respond to it.
-		delay = (n < 1 || lua_isnil(self->thread, -1)) ? -1 :
-			lua_tointeger(self->thread, -1);
-		lua_settop(self->thread, 1);
 
+		// Events with a handler are handled without resuming the script, and
+		// do not end its wait.
 		Event event;
-		if (!event_wait(delay, &event, self->queue)) {
+		bool received;
+		TickType_t wait_start = xTaskGetTickCount();
+		while (true) {
+			int timeout = delay;
+			if (delay > 0) {
+				int elapsed =
+					(xTaskGetTickCount() - wait_start) * portTICK_PERIOD_MS;
+				timeout = elapsed < delay ? delay - elapsed : 0;
+			}
+			received = event_task_wait(self, timeout, &event);
+			if (!received || !run_handler(self, &event))
+				break;
+		}
+		if (!received) {
+			self->source_time = 0;
 			r = run_lua(self, 0, &n);
 			continue;
 		}
-		if (event.eventcode == 0) {
-			// Special case for startup.lua resume after setup.
-			r = run_lua(self, 0, &n);
+		r = script_event(self, &event, &n);
+	}
+}
+#else
+// All launched scripts run in the executor task. It waits for the queues of
+// every script with one queue set. Every item that is sent to a member adds
+// one entry to the set, and the executor credits each entry that it takes to
+// the script that owns the queue. A script only receives from a queue with
+// credit, so the entries always match the items, even though queues of
+// different scripts share the set.
+
+// Set entries for the wake queue.
+#define EXECUTOR_WAKE_ENTRIES 1
+
+static QueueSetHandle_t executor_set;
+static QueueHandle_t executor_wake;	// Tells the executor about new scripts.
+static int executor_entries = EXECUTOR_WAKE_ENTRIES;	// Used set entries.
+
+// Set entries that a script uses: one for every event that its queues can
+// hold.
+static int executor_script_entries(const ScriptTask *self)
+{
+	return event_queue_max_items(self->queue_length) +
+		event_queue_max_items(self->urgent_length) +
+		event_queue_max_items(2);
+}
+
+static bool executor_init()
+{
+	executor_set = xQueueCreateSet(CONFIG_EVENT_LUA_EXECUTOR_SET_LENGTH);
+	executor_wake = xQueueCreate(EXECUTOR_WAKE_ENTRIES, sizeof(uint8_t));
+	if (executor_set == NULL || executor_wake == NULL)
+		return false;
+	xQueueAddToSet(executor_wake, executor_set);
+	return pdPASS == xTaskCreate(&executor_task, "lua-executor",
+		TASK_STACK_SIZE, NULL, 0, NULL);
+}
+
+// Hand a launched script to the executor.
+static bool executor_add(ScriptTask *self)
+{
+	int entries = executor_script_entries(self);
+	if (__atomic_add_fetch(&executor_entries, entries, __ATOMIC_RELAXED) >
+		CONFIG_EVENT_LUA_EXECUTOR_SET_LENGTH) {
+		__atomic_sub_fetch(&executor_entries, entries, __ATOMIC_RELAXED);
+		printf(_("Lua executor queue set is full\n"));
+		return false;
+	}
+	// A queue can only join a set when it is empty. The reply queue may hold
+	// late replies to an earlier task in this slot.
+	Event reply;
+	while (event_wait(0, &reply, self->replies))
+		event_free(&reply);
+	xRingbufferAddToQueueSetRead(self->queue, executor_set);
+	if (self->urgent != NULL)
+		xRingbufferAddToQueueSetRead(self->urgent, executor_set);
+	xRingbufferAddToQueueSetRead(self->replies, executor_set);
+	self->ready = 0;
+	self->urgent_ready = 0;
+	self->replies_ready = 0;
+	self->timed = false;
+	__atomic_store_n(&self->state, SCRIPT_START, __ATOMIC_RELEASE);
+	uint8_t wake = 0;
+	xQueueSend(executor_wake, &wake, 0);
+	return true;
+}
+
+// Take the queues of an ending script out of the set. The event queues must
+// be empty already.
+static void executor_remove(ScriptTask *self)
+{
+	Event reply;
+	while (event_wait(0, &reply, self->replies))
+		event_free(&reply);
+	xRingbufferRemoveFromQueueSetRead(self->replies, executor_set);
+	if (self->urgent != NULL)
+		xRingbufferRemoveFromQueueSetRead(self->urgent, executor_set);
+	xRingbufferRemoveFromQueueSetRead(self->queue, executor_set);
+	__atomic_sub_fetch(&executor_entries, executor_script_entries(self),
+		__ATOMIC_RELAXED);
+	self->state = SCRIPT_IDLE;
+}
+
+// Credit an entry that was taken from the set to the queue it belongs to.
+static void executor_credit(QueueSetMemberHandle_t member)
+{
+	if (member == (QueueSetMemberHandle_t)executor_wake) {
+		uint8_t wake;
+		xQueueReceive(executor_wake, &wake, 0);
+		return;
+	}
+	int task;
+	for (task = 0; task < MAX_TASKS; ++task) {
+		ScriptTask *self = &tasks[task];
+		if (self->state == SCRIPT_IDLE)
 			continue;
+		if (xRingbufferCanRead(self->queue, member)) {
+			++self->ready;
+			return;
 		}
-		assert(event.eventcode >= 1 && event.eventcode < max_event);
-		EventType *def = &event_defs[event.eventcode];
-		if (def->raw) {
-			// Handle event raw.
-			lua_createtable(self->thread,
-				1 + def->num_float + def->num_int + def->num_str, 0);
-			lua_pushinteger(self->thread, event.eventcode);
-			lua_rawseti(self->thread, -2, 1);
-			int pos = 2;
-			int num;
-			for (num = 0; num < def->num_float; ++num) {
-				lua_pushnumber(self->thread, event.f[num]);
-				lua_rawseti(self->thread, -2, pos);
-				++pos;
-			}
-			for (num = 0; num < def->num_int; ++num) {
-				lua_pushinteger(self->thread, event.i[num]);
-				lua_rawseti(self->thread, -2, pos);
-				++pos;
-			}
-			for (num = 0; num < def->num_float; ++num) {
-				lua_pushstring(self->thread, event.s[num]);
-				lua_rawseti(self->thread, -2, pos);
-				++pos;
-			}
-		} else {
-			// Parse event.
-			lua_createtable(self->thread,
-				0, 1 + def->num_float + def->num_int + def->num_str);
-			const char *event_name = event_get_name(event.eventcode);
-			lua_pushliteral(self->thread, "event");
-			lua_pushstring(self->thread, event_name);
-			lua_rawset(self->thread, -3);
-			int num;
-			for (num = 0; num < def->num_float; ++num) {
-				lua_pushstring(self->thread, def->f[num]);
-				lua_pushnumber(self->thread, event.f[num]);
-				lua_rawset(self->thread, -3);
-			}
-			for (num = 0; num < def->num_int; ++num) {
-				lua_pushstring(self->thread, def->i[num]);
-				lua_pushinteger(self->thread, event.i[num]);
-				lua_rawset(self->thread, -3);
+		if (self->urgent != NULL && xRingbufferCanRead(self->urgent, member)) {
+			++self->urgent_ready;
+			return;
+		}
+		if (xRingbufferCanRead(self->replies, member)) {
+			++self->replies_ready;
+			return;
+		}
+	}
+	// The queue left the set after the entry was added.
+}
+
+static void executor_set_deadline(ScriptTask *self, int timeout)
+{
+	self->timed = timeout >= 0;
+	self->deadline = event_now() + (uint32_t)(timeout > 0 ? timeout : 0) * 1000;
+}
+
+static bool executor_expired(const ScriptTask *self)
+{
+	return self->timed && (int32_t)(event_now() - self->deadline) >= 0;
+}
+
+// Receive a credited event for the script, urgent events first.
+static bool executor_receive(ScriptTask *self, Event *event)
+{
+	while (self->urgent_ready > 0) {
+		--self->urgent_ready;
+		if (event_wait(0, event, self->urgent)) {
+			update_depth(self->urgent, &self->urgent_max_depth);
+			return true;
+		}
+	}
+	while (self->ready > 0) {
+		--self->ready;
+		if (event_wait(0, event, self->queue)) {
+			update_depth(self->queue, &self->max_depth);
+			return true;
+		}
+	}
+	// Coalesced events leave entries without items.
+	return false;
+}
+
+// Continue after the script was resumed, until it waits again.
+static void executor_resumed(ScriptTask *self, int r, int n)
+{
+	while (true) {
+		if (r != LUA_YIELD) {
+			// Thread returned or produced an error.
+			script_end(self, r);
+			return;
+		}
+		if (self->call != 0) {
+			// The script waits for the reply to event.call.
+			self->state = SCRIPT_REPLY;
+			executor_set_deadline(self, self->call_timeout);
+			return;
+		}
+		int delay = yielded_delay(self, n);
+		if (delay == YIELD_STUCK) {
+			// The script is never resumed again, like in its own task.
+			self->state = SCRIPT_STUCK;
+			return;
+		}
+		if (delay != YIELD_INVALID) {
+			self->state = SCRIPT_EVENT;
+			executor_set_deadline(self, delay);
+			return;
+		}
+		r = run_lua(self, 0, &n);
+	}
+}
+
+// Run the script if it can continue. Returns false if it still waits.
+static bool executor_step(ScriptTask *self)
+{
+	int n;
+	int r;
+	switch (__atomic_load_n(&self->state, __ATOMIC_ACQUIRE)) {
+	case SCRIPT_START:
+		if (!script_load(self))
+			return true;
+		r = run_lua(self, 0, &n); // Start script.
+		break;
+	case SCRIPT_REPLY:
+		if (self->replies_ready > 0) {
+			--self->replies_ready;
+			Event reply;
+			if (!event_wait(0, &reply, self->replies))
+				return true;
+			if (reply.call != self->call) {
+				// Late reply to an earlier call that timed out.
+				event_free(&reply);
+				return true;
 			}
-			for (num = 0; num < def->num_float; ++num) {
-				lua_pushstring(self->thread, def->s[num]);
-				lua_pushstring(self->thread, event.s[num]);
-				lua_rawset(self->thread, -3);
+			self->call = 0;
+			r = run_lua(self, push_reply(self->thread, &reply), &n);
+			break;
+		}
+		if (!executor_expired(self))
+			return false;
+		self->call = 0;
+		r = run_lua(self, 0, &n);
+		break;
+	case SCRIPT_EVENT: {
+		Event event;
+		if (!executor_receive(self, &event)) {
+			if (!executor_expired(self))
+				return false;
+			self->source_time = 0;
+			r = run_lua(self, 0, &n);
+			break;
+		}
+		// Events with a handler do not end the wait.
+		if (run_handler(self, &event))
+			return true;
+		r = script_event(self, &event, &n);
+		break;
+	}
+	default:
+		return false;
+	}
+	executor_resumed(self, r, n);
+	return true;
+}
+
+static void executor_task(void *arg)
+{
+	(void)&arg;
+	while (true) {
+		// Run every script that can continue, until all of them wait.
+		bool progress = true;
+		while (progress) {
+			progress = false;
+			int task;
+			for (task = 0; task < MAX_TASKS; ++task) {
+				if (tasks[task].active && executor_step(&tasks[task]))
+					progress = true;
 			}
 		}
-		event_free(&event);
-		r = run_lua(self, 1, &n);
+		// Sleep until an item arrives or the first wait ends. With at most
+		// MAX_TASKS scripts, a scan is cheaper than keeping the deadlines
+		// sorted.
+		TickType_t wait = portMAX_DELAY;
+		uint32_t now = event_now();
+		int task;
+		for (task = 0; task < MAX_TASKS; ++task) {
+			const ScriptTask *self = &tasks[task];
+			if (!self->active || !self->timed ||
+				(self->state != SCRIPT_EVENT && self->state != SCRIPT_REPLY))
+				continue;
+			int32_t left = self->deadline - now;
+			TickType_t ticks = left <= 0 ? 0 :
+				(left + portTICK_PERIOD_MS * 1000 - 1) /
+				(portTICK_PERIOD_MS * 1000);
+			if (ticks < wait)
+				wait = ticks;
+		}
+		QueueSetMemberHandle_t member = xQueueSelectFromSet(executor_set, wait);
+		while (member != NULL) {
+			executor_credit(member);
+			member = xQueueSelectFromSet(executor_set, 0);
+		}
+	}
+}
+#endif
+
+int event_push(lua_State *L, const Event *event, EventDelivery delivery,
+	int table)
+{
+	EventType *def = &event_defs[EVENT_INDEX(event->eventcode)];
+	int num;
+	if (delivery == EVENT_DELIVER_VALUES) {
+		// No table at all: the code and the parameters are separate values.
+		lua_pushinteger(L, event->eventcode);
+		for (num = 0; num < def->num_float; ++num)
+			lua_pushnumber(L, event->f[num]);
+		for (num = 0; num < def->num_int; ++num)
+			lua_pushinteger(L, event->i[num]);
+		for (num = 0; num < def->num_str; ++num)
+			lua_pushstring(L, event->s[num]);
+		return 1 + def->num_float + def->num_int + def->num_str;
+	}
+	if (delivery == EVENT_DELIVER_PARSED) {
+		// The names come from the interned keys, so they are not hashed
+		// again for every event.
+		int count = def->num_float + def->num_int + def->num_str;
+		event_push_keys(L, def);
+		int keys = lua_gettop(L);
+		lua_createtable(L, 0, 2 + count);
+		lua_rawgeti(L, LUA_REGISTRYINDEX, event_key);
+		lua_rawgeti(L, keys, count + 1);
+		lua_rawset(L, -3);
+		int pos = 1;
+		for (num = 0; num < def->num_float; ++num) {
+			lua_rawgeti(L, keys, pos++);
+			lua_pushnumber(L, event->f[num]);
+			lua_rawset(L, -3);
+		}
+		for (num = 0; num < def->num_int; ++num) {
+			lua_rawgeti(L, keys, pos++);
+			lua_pushinteger(L, event->i[num]);
+			lua_rawset(L, -3);
+		}
+		for (num = 0; num < def->num_str; ++num) {
+			lua_rawgeti(L, keys, pos++);
+			lua_pushstring(L, event->s[num]);
+			lua_rawset(L, -3);
+		}
+		if (event->t != 0) {
+			lua_rawgeti(L, LUA_REGISTRYINDEX, time_key);
+			lua_pushinteger(L, event->t);
+			lua_rawset(L, -3);
+		}
+		lua_remove(L, keys);
+		return 1;
+	}
+	// Raw table: a new one, or the same one for every event. The reused table
+	// may still hold a longer previous event, so clear what is not used.
+	int len = 1 + def->num_float + def->num_int + def->num_str;
+	int old_len = 0;
+	if (delivery == EVENT_DELIVER_REUSE) {
+		lua_rawgeti(L, LUA_REGISTRYINDEX, table);
+		old_len = lua_rawlen(L, -1);
+	} else
+		lua_createtable(L, len, 1);
+	lua_pushinteger(L, event->eventcode);
+	lua_rawseti(L, -2, 1);
+	int pos = 2;
+	for (num = 0; num < def->num_float; ++num) {
+		lua_pushnumber(L, event->f[num]);
+		lua_rawseti(L, -2, pos++);
+	}
+	for (num = 0; num < def->num_int; ++num) {
+		lua_pushinteger(L, event->i[num]);
+		lua_rawseti(L, -2, pos++);
+	}
+	for (num = 0; num < def->num_str; ++num) {
+		lua_pushstring(L, event->s[num]);
+		lua_rawseti(L, -2, pos++);
+	}
+	for (; pos <= old_len; ++pos) {
+		lua_pushnil(L);
+		lua_rawseti(L, -2, pos);
+	}
+	if (event->t != 0)
+		lua_pushinteger(L, event->t);
+	else
+		lua_pushnil(L);
+	lua_setfield(L, -2, "t");
+	return 1;
+}
+
+void event_push_keys(lua_State *L, EventType *def)
+{
+	if (def->keys != 0) {
+		lua_rawgeti(L, LUA_REGISTRYINDEX, def->keys);
+		return;
+	}
+	int count = def->num_float + def->num_int + def->num_str;
+	lua_createtable(L, count + 1, 0);
+	int pos = 1;
+	int num;
+	for (num = 0; num < def->num_float; ++num) {
+		lua_pushstring(L, def->f[num]);
+		lua_rawseti(L, -2, pos++);
+	}
+	for (num = 0; num < def->num_int; ++num) {
+		lua_pushstring(L, def->i[num]);
+		lua_rawseti(L, -2, pos++);
+	}
+	for (num = 0; num < def->num_str; ++num) {
+		lua_pushstring(L, def->s[num]);
+		lua_rawseti(L, -2, pos++);
+	}
+	lua_pushstring(L, def->name);
+	lua_rawseti(L, -2, pos);
+	lua_pushvalue(L, -1);
+	def->keys = luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+// Call the handler that the script registered for an event with event.on,
+// with the parameters of the event as arguments. Returns false if there is no
+// handler; the event is then not used.
+static bool run_handler(ScriptTask *self, Event *event)
+{
+	int index = EVENT_INDEX(event->eventcode);
+	if (index < 1 || index >= MAX_EVENTS || self->handlers[index] == 0)
+		return false;
+	uint32_t start = event_now();
+	self->source_time = event->t;
+	lua_State *L = self->handler_thread;
+	const EventType *def = &event_defs[index];
+	lua_rawgeti(L, LUA_REGISTRYINDEX, self->handlers[index]);
+	int num;
+	for (num = 0; num < def->num_float; ++num)
+		lua_pushnumber(L, event->f[num]);
+	for (num = 0; num < def->num_int; ++num)
+		lua_pushinteger(L, event->i[num]);
+	for (num = 0; num < def->num_str; ++num)
+		lua_pushstring(L, event->s[num]);
+	event_free(event);
+	int nargs = def->num_float + def->num_int + def->num_str;
+	// Handlers cannot yield, so they cannot wait; event.call waits in place.
+	current_lua_thread = self;
+	self->command = true;
+	trace_record(TRACE_RESUME, event->eventcode, nargs);
+	if (LUA_OK != lua_pcall(L, nargs, 0, 0)) {
+		printf(_("Handler for %s returned error: %s\n"), def->name,
+			lua_tostring(L, -1));
+		reply_send(cli_reply_cb, NULL, "");
 	}
+	trace_record(TRACE_YIELD, event->eventcode, 0);
+	self->command = false;
+	lua_settop(L, 0);
+	event_handled(event, start);
+	return true;
+}
+
+// Convert the table at idx (which must be an absolute index) to an event.
+// Tables with a sequence part are raw events, others are parsed.
+static bool marshal_event(lua_State *L, int idx, Event *event)
+{
+	event->more = false;
+	event->call = 0;
+	// Unless the table has a source time, the event shares the source of the
+	// event or command that the task is handling.
+	event->t = current_lua_thread->source_time;
+	if (lua_istable(L, idx)) {
+		if (lua_getfield(L, idx, "t") == LUA_TNUMBER && lua_isinteger(L, -1))
+			event->t = lua_tointeger(L, -1);
+		lua_pop(L, 1);
+	}
+	if (lua_istable(L, idx) && lua_rawlen(L, idx) > 0)
+		return marshal_raw_event(L, idx, event);
+	return marshal_parsed_event(L, idx, event);
 }
 
-static void handle_raw_event(ScriptTask *self)
+static bool marshal_raw_event(lua_State *L, int idx, Event *event)
 {
 	// This is a "raw" event. Don't attempt parameter lookup.
 	// The first element is the event code.
-	Event event;
-	if (!lua_istable(self->thread, 1)) {
+	if (!lua_istable(L, idx)) {
 		printf("invalid event; argument is not a table\n");
-		print_lua_stack(self->thread);
-		return;
+		print_lua_stack(L);
+		return false;
 	}
-	lua_pushinteger(self->thread, 1);
-	lua_gettable(self->thread, 1);
-	event.eventcode = lua_tointeger(self->thread, -1);
-	lua_pop(self->thread, 1);
-	if (event.eventcode < 1 || event.eventcode >= max_event ||
-		event_defs[event.eventcode].name == NULL) {
+	lua_pushinteger(L, 1);
+	lua_gettable(L, idx);
+	event->eventcode = lua_tointeger(L, -1);
+	lua_pop(L, 1);
+	EventType *def = get_def(event->eventcode);
+	if (def == NULL) {
 		// Invalid event code; ignore.
-		printf(_("invalid event code %d\n"), event.eventcode);
-		return;
+		printf(_("invalid event code %d\n"), event->eventcode);
+		return false;
 	}
-	EventType *def = &event_defs[event.eventcode];
-	if (def->name == NULL || def->queue == NULL) {
+	EventQueue queues[1 + MAX_SUBSCRIBERS];
+	if (event_receivers(def, queues) == 0) {
 		// Invalid or unclaimed event; ignore.
-		printf(_("invalid or unclaimed event code %d\n"), event.eventcode);
-		return;
+		printf(_("invalid or unclaimed event code %d\n"), event->eventcode);
+		return false;
 	}
 	int pos = 2;
 	int num;
 
 	for (num = 0; num < def->num_int; ++num) {
-		lua_geti(self->thread, 1, pos);
-		event.i[num] = lua_tointeger(self->thread, -1);
-		lua_pop(self->thread, 1);
+		lua_geti(L, idx, pos);
+		event->i[num] = lua_tointeger(L, -1);
+		lua_pop(L, 1);
 		++pos;
 	}
 	for (; num < 6; ++num)
-		event.i[num] = 0;
+		event->i[num] = 0;
 
 	for (num = 0; num < def->num_float; ++num) {
-		lua_geti(self->thread, 1, pos);
-		event.f[num] = lua_tonumber(self->thread, -1);
-		lua_pop(self->thread, 1);
+		lua_geti(L, idx, pos);
+		event->f[num] = lua_tonumber(L, -1);
+		lua_pop(L, 1);
 		++pos;
 	}
 	for (; num < 3; ++num)
-		event.f[num] = NAN;
+		event->f[num] = NAN;
 
 	for (num = 0; num < def->num_str; ++num) {
-		lua_geti(self->thread, 1, pos);
-		const char *str = lua_tostring(self->thread, -1);
+		lua_geti(L, idx, pos);
+		size_t len;
+		const char *str = lua_tolstring(L, -1, &len);
 		if (str == NULL) {
 			// Invalid event. Send with empty string.
 			printf(_("invalid string in event\n"));
 			str = "";
+			len = 0;
 		}
-		event.s[num] = strdup(str);
-		lua_pop(self->thread, 1);
+		event->s[num] = event_strdup(str, len);
+		lua_pop(L, 1);
 		++pos;
 	}
 	for (; num < 3; ++num)
-		event.s[num] = NULL;
+		event->s[num] = NULL;
 
-	event_send(&event);
+	return true;
 }
 
-static void handle_parsed_event(ScriptTask *self)
+static bool marshal_parsed_event(lua_State *L, int idx, Event *event)
 {
-	if (!lua_istable(self->thread, 1)) {
+	if (!lua_istable(L, idx)) {
 		printf("invalid event; argument is not a table\n");
-		print_lua_stack(self->thread);
-		return;
+		print_lua_stack(L);
+		return false;
 	}
-	lua_pushliteral(self->thread, "event");
-	lua_gettable(self->thread, 1);
-	const char *event_name = lua_tostring(self->thread, -1);
-	Event event;
-	event.eventcode = event_find(event_name);
-	if (event.eventcode == 0) {
+	lua_rawgeti(L, LUA_REGISTRYINDEX, event_key);
+	lua_rawget(L, idx);
+	const char *event_name = lua_tostring(L, -1);
+	event->eventcode = event_find(event_name);
+	if (event->eventcode == 0) {
 		// Event name was not found; ignore.
 		printf(_("unrecognized event name %s\n"), event_name);
-		return;
+		lua_pop(L, 1);
+		return false;
 	}
-	lua_pop(self->thread, 1);
-	EventType *def = &event_defs[event.eventcode];
+	lua_pop(L, 1);
+	EventType *def = &event_defs[EVENT_INDEX(event->eventcode)];
 	int num;
+	event_push_keys(L, def);
+	int keys = lua_gettop(L);
 
 	for (num = 0; num < def->num_int; ++num) {
-		lua_pushstring(self->thread, def->i[num]);
-		lua_gettable(self->thread, 1);
-		event.i[num] = lua_tointeger(self->thread, -1);
-		lua_pop(self->thread, 1);
+		lua_rawgeti(L, keys, def->num_float + 1 + num);
+		lua_rawget(L, idx);
+		event->i[num] = lua_tointeger(L, -1);
+		lua_pop(L, 1);
 	}
 	for (; num < 6; ++num)
-		event.i[num] = 0;
+		event->i[num] = 0;
 
 	for (num = 0; num < def->num_float; ++num) {
-		lua_pushstring(self->thread, def->f[num]);
-		lua_gettable(self->thread, 1);
-		event.f[num] = lua_tonumber(self->thread, -1);
-		lua_pop(self->thread, 1);
+		lua_rawgeti(L, keys, 1 + num);
+		lua_rawget(L, idx);
+		event->f[num] = lua_tonumber(L, -1);
+		lua_pop(L, 1);
 	}
 	for (; num < 3; ++num)
-		event.f[num] = 0;
+		event->f[num] = 0;
 
 	for (num = 0; num < def->num_str; ++num) {
-		lua_pushstring(self->thread, def->s[num]);
-		lua_gettable(self->thread, 1);
-		const char *str = lua_tostring(self->thread, -1);
+		lua_rawgeti(L, keys, def->num_float + def->num_int + 1 + num);
+		lua_rawget(L, idx);
+		size_t len;
+		const char *str = lua_tolstring(L, -1, &len);
 		if (str == NULL) {
 			// Invalid event. Send with empty string.
 			printf(_("invalid named string in event\n"));
 			str = "";
+			len = 0;
 		}
-		event.s[num] = strdup(str);
-		lua_pop(self->thread, 1);
+		event->s[num] = event_strdup(str, len);
+		lua_pop(L, 1);
 	}
 	for (; num < 3; ++num)
-		event.s[num] = NULL;
+		event->s[num] = NULL;
+	lua_pop(L, 1);
 
-	event_send(&event);
+	return true;
 }
 
 static int event_lua_claim(lua_State *L)
@@ -790,13 +3229,10 @@ static int event_lua_claim(lua_State *L)
 		printf(_("claim called without arguments\n"));
 		return 0;
 	}
-	bool raw = false;
-	if (nargs >= 2) {
-		if (!lua_isboolean(L, 2)) {
-			printf(_("raw argument to claim is not a boolean\n"));
-			return 0;
-		}
-		raw = lua_toboolean(L, 2);
+	EventDelivery delivery;
+	if (!parse_delivery(L, 2, &delivery)) {
+		printf(_("invalid raw argument to claim\n"));
+		return 0;
 	}
 	int eventcode;
 	if (lua_isinteger(L, 1)) {
@@ -805,11 +3241,113 @@ static int event_lua_claim(lua_State *L)
 		const char *name = lua_tostring(L, 1);
 		eventcode = event_find(name);
 	}
+	EventFilter filter;
+	bool filtered = false;
+	EventQueue queue = current_lua_thread->queue;
+	EventType *def = get_def(eventcode);
+	if (nargs >= 3 && def != NULL) {
+		if (!parse_filter(L, 3, def, &filter)) {
+			lua_settop(L, 0);
+			return 0;
+		}
+		filtered = true;
+		lua_getfield(L, 3, "urgent");
+		if (lua_toboolean(L, -1)) {
+			if (current_lua_thread->urgent != NULL)
+				queue = current_lua_thread->urgent;
+			else
+				printf(_("Task has no urgent queue; claiming %s normally\n"),
+					def->name);
+		}
+	}
 	lua_settop(L, 0);
-	event_claim(eventcode, raw, current_lua_thread->queue);
+	if (event_claim(eventcode, delivery, queue) && filtered)
+		event_filter(eventcode, &filter);
 	return 0;
 }
 
+// Parse the raw argument of event.claim and event.subscribe: a boolean for a
+// raw or parsed table, or the name of a delivery mode.
+static bool parse_delivery(lua_State *L, int idx, EventDelivery *delivery)
+{
+	static const char *const modes[] = { "parsed", "raw", "values", "reuse",
+		NULL };
+	if (lua_isnoneornil(L, idx) || lua_isboolean(L, idx)) {
+		*delivery = lua_toboolean(L, idx) ? EVENT_DELIVER_RAW :
+			EVENT_DELIVER_PARSED;
+		return true;
+	}
+	if (!lua_isstring(L, idx))
+		return false;
+	const char *name = lua_tostring(L, idx);
+	int mode;
+	for (mode = 0; modes[mode] != NULL; ++mode) {
+		if (strcmp(modes[mode], name) == 0) {
+			*delivery = mode;
+			return true;
+		}
+	}
+	return false;
+}
+
+// Parse the filter argument of event.claim: a table with an optional test
+// of one int parameter (field, with equals, differs or changed), and an
+// optional rate limit.
+static bool parse_filter(lua_State *L, int idx, const EventType *def,
+	EventFilter *filter)
+{
+	if (!lua_istable(L, idx)) {
+		printf(_("filter argument to claim is not a table\n"));
+		return false;
+	}
+	filter->test = EVENT_FILTER_ANY;
+	filter->field = 0;
+	filter->value = 0;
+	filter->rate = 0;
+	lua_getfield(L, idx, "rate");
+	if (!lua_isnil(L, -1)) {
+		if (!lua_isinteger(L, -1) || lua_tointeger(L, -1) < 0) {
+			printf(_("Invalid rate in filter\n"));
+			return false;
+		}
+		filter->rate = lua_tointeger(L, -1);
+	}
+	lua_getfield(L, idx, "equals");
+	lua_getfield(L, idx, "differs");
+	lua_getfield(L, idx, "changed");
+	if (lua_toboolean(L, -1))
+		filter->test = EVENT_FILTER_CHANGED;
+	else if (lua_isinteger(L, -2)) {
+		filter->test = EVENT_FILTER_DIFFERENT;
+		filter->value = lua_tointeger(L, -2);
+	} else if (lua_isinteger(L, -3)) {
+		filter->test = EVENT_FILTER_EQUAL;
+		filter->value = lua_tointeger(L, -3);
+	}
+	lua_pop(L, 4);
+	if (filter->test == EVENT_FILTER_ANY)
+		return true;
+	// The field is an int parameter, by name or by (1-based) position.
+	lua_getfield(L, idx, "field");
+	if (lua_isinteger(L, -1))
+		filter->field = lua_tointeger(L, -1) - 1;
+	else if (lua_isstring(L, -1)) {
+		const char *name = lua_tostring(L, -1);
+		for (filter->field = 0; filter->field < def->num_int;
+			++filter->field) {
+			if (def->i[filter->field] != NULL &&
+				strcmp(def->i[filter->field], name) == 0)
+				break;
+		}
+	}
+	lua_pop(L, 1);
+	if (filter->field < 0 || filter->field >= def->num_int) {
+		printf(_("Invalid field in filter for event %s\n"), def->name);
+		return false;
+	}
+	return true;
+}
+
 static int event_lua_release(lua_State *L)
 {
 	int nargs = lua_gettop(L);
@@ -829,6 +3367,49 @@ static int event_lua_release(lua_State *L)
 	return 0;
 }
 
+static int event_lua_subscribe(lua_State *L)
+{
+	int nargs = lua_gettop(L);
+	if (nargs < 1) {
+		printf(_("subscribe called without arguments\n"));
+		return 0;
+	}
+	EventDelivery delivery;
+	if (!parse_delivery(L, 2, &delivery)) {
+		printf(_("invalid raw argument to subscribe\n"));
+		return 0;
+	}
+	int eventcode;
+	if (lua_isinteger(L, 1)) {
+		eventcode = lua_tointeger(L, 1);
+	} else {
+		const char *name = lua_tostring(L, 1);
+		eventcode = event_find(name);
+	}
+	lua_settop(L, 0);
+	event_subscribe(eventcode, delivery, current_lua_thread->queue);
+	return 0;
+}
+
+static int event_lua_unsubscribe(lua_State *L)
+{
+	int nargs = lua_gettop(L);
+	if (nargs < 1) {
+		printf(_("unsubscribe called without arguments\n"));
+		return 0;
+	}
+	int eventcode;
+	if (lua_isinteger(L, 1)) {
+		eventcode = lua_tointeger(L, 1);
+	} else {
+		const char *name = lua_tostring(L, 1);
+		eventcode = event_find(name);
+	}
+	lua_settop(L, 0);
+	event_unsubscribe(eventcode, current_lua_thread->queue);
+	return 0;
+}
+
 static int event_lua_find(lua_State *L)
 {
 	int nargs = lua_gettop(L);
@@ -897,6 +3478,21 @@ static int cleanup(lua_State *L, const char *i[6], const char *f[3],
 	return 0;
 }
 
+static unsigned parse_event_flags(lua_State *L, int idx)
+{
+	if (!lua_istable(L, idx))
+		return 0;
+	unsigned flags = 0;
+	lua_getfield(L, idx, "coalesce");
+	bool coalesce = lua_toboolean(L, -1);
+	lua_getfield(L, idx, "keyed");
+	bool keyed = lua_toboolean(L, -1);
+	lua_pop(L, 2);
+	if (coalesce)
+		flags |= keyed ? EVENT_COALESCE_KEY : EVENT_COALESCE;
+	return flags;
+}
+
 static int event_lua_new(lua_State *L)
 {
 	int nargs = lua_gettop(L);
@@ -904,6 +3500,7 @@ static int event_lua_new(lua_State *L)
 		printf(_("new called with fewer than 4 arguments\n"));
 		return 0;
 	}
+	unsigned flags = nargs >= 5 ? parse_event_flags(L, 5) : 0;
 	const char *name = lua_tostring(L, 1);
 	const char *i[6] = { NULL, NULL, NULL, NULL, NULL, NULL };
 	const char *f[3] = { NULL, NULL, NULL };
@@ -914,12 +3511,39 @@ static int event_lua_new(lua_State *L)
 		return cleanup(L, i, f, s);
 	if (!fill_names(L, 4, s, 3))
 		return cleanup(L, i, f, s);
-	int eventcode = event_new(name, i, f, s);
+	int eventcode = event_new(name, i, f, s, flags);
+	if (eventcode == 0)
+		cleanup(L, i, f, s);
 	lua_settop(L, 0);
+	if (eventcode != 0) {
+		// The event is deleted with the task, and its names are freed.
+		EventType *def = &event_defs[EVENT_INDEX(eventcode)];
+		def->owner = current_lua_thread;
+		// Intern the names now, instead of when the first event is handled.
+		event_push_keys(L, def);
+		lua_pop(L, 1);
+	}
 	lua_pushinteger(L, eventcode);
 	return 1;
 }
 
+static int event_lua_delete(lua_State *L)
+{
+	int nargs = lua_gettop(L);
+	if (nargs < 1) {
+		printf(_("delete called without arguments\n"));
+		return 0;
+	}
+	int eventcode;
+	if (lua_isinteger(L, 1))
+		eventcode = lua_tointeger(L, 1);
+	else
+		eventcode = event_find(lua_tostring(L, 1));
+	lua_settop(L, 0);
+	lua_pushboolean(L, event_delete(eventcode));
+	return 1;
+}
+
 static int event_lua_send(lua_State *L)
 {
 	if (current_lua_thread->thread != L) {
@@ -929,11 +3553,9 @@ static int event_lua_send(lua_State *L)
 	//print_lua_stack(L);
 	if (lua_istable(L, 1)) {
 		// Value is a table; send the event.
-		unsigned len = lua_rawlen(L, 1);
-		if (len > 0)
-			handle_raw_event(current_lua_thread);
-		else
-			handle_parsed_event(current_lua_thread);
+		Event event;
+		if (marshal_event(L, 1, &event))
+			event_send(&event);
 	} else {
 		// Invalid value; ignore.
 		printf(_("Invalid argument for send\n"));
@@ -942,17 +3564,386 @@ static int event_lua_send(lua_State *L)
 	return 0;
 }
 
+static int event_lua_send_many(lua_State *L)
+{
+	if (!lua_istable(L, 1)) {
+		printf(_("Invalid argument for send_many\n"));
+		lua_settop(L, 0);
+		return 0;
+	}
+	int num = lua_rawlen(L, 1);
+	if (num > MAX_BATCH) {
+		printf(_("Too many events for send_many (%d, maximum is %d)\n"), num,
+			MAX_BATCH);
+		lua_settop(L, 0);
+		return 0;
+	}
+	Event events[MAX_BATCH];
+	int e;
+	for (e = 0; e < num; ++e) {
+		lua_rawgeti(L, 1, e + 1);
+		bool ok = marshal_event(L, lua_gettop(L), &events[e]);
+		lua_pop(L, 1);
+		if (!ok) {
+			// Send nothing if any of the events is invalid.
+			while (e > 0)
+				event_free(&events[--e]);
+			lua_settop(L, 0);
+			return 0;
+		}
+	}
+	event_send_batch(events, num);
+	lua_settop(L, 0);
+	return 0;
+}
+
 static int event_lua_launch(lua_State *L)
 {
 	const char *name = lua_tostring(L, 1);
-	launch_lua_task(name);
+	// Optional table with the queue capacities.
+	int queue_length = 0;
+	int urgent_length = 0;
+	if (lua_istable(L, 2)) {
+		lua_getfield(L, 2, "queue");
+		lua_getfield(L, 2, "urgent");
+		queue_length = lua_tointeger(L, -2);
+		urgent_length = lua_tointeger(L, -1);
+		if (queue_length < 0 || queue_length > MAX_QUEUE_LENGTH ||
+			urgent_length < 0 || urgent_length > MAX_QUEUE_LENGTH) {
+			printf(_("Queue lengths for launch must be 0 to %d\n"),
+				MAX_QUEUE_LENGTH);
+			lua_settop(L, 0);
+			return 0;
+		}
+	}
+	launch_lua_task(name, queue_length, urgent_length);
+	lua_settop(L, 0);
+	return 0;
+}
+
+static int event_lua_tasks(lua_State *L)
+{
+	lua_settop(L, 0);
+	lua_createtable(L, 0, MAX_TASKS);
+	int task;
+	for (task = 0; task < MAX_TASKS; ++task) {
+		ScriptTask *self = &tasks[task];
+		if (!self->active)
+			continue;
+		lua_createtable(L, 0, 4);
+		lua_pushinteger(L, self->queue_length);
+		lua_setfield(L, -2, "queue");
+		lua_pushinteger(L, self->max_depth);
+		lua_setfield(L, -2, "max_depth");
+		lua_pushinteger(L, self->urgent_length);
+		lua_setfield(L, -2, "urgent");
+		lua_pushinteger(L, self->urgent_max_depth);
+		lua_setfield(L, -2, "urgent_max_depth");
+		lua_setfield(L, -2, self->name);
+	}
+	return 1;
+}
+
+static int event_lua_coalesced(lua_State *L)
+{
+	int nargs = lua_gettop(L);
+	if (nargs < 1) {
+		printf(_("coalesced called without arguments\n"));
+		return 0;
+	}
+	int eventcode = lua_tointeger(L, 1);
+	lua_settop(L, 0);
+	EventType *def = get_def(eventcode);
+	if (def == NULL)
+		return 0;
+	lua_pushinteger(L, def->stats.coalesced);
+	return 1;
+}
+
+static int event_lua_dropped(lua_State *L)
+{
+	int nargs = lua_gettop(L);
+	if (nargs < 1) {
+		printf(_("dropped called without arguments\n"));
+		return 0;
+	}
+	int eventcode = lua_tointeger(L, 1);
+	lua_settop(L, 0);
+	EventType *def = get_def(eventcode);
+	if (def == NULL)
+		return 0;
+	lua_pushinteger(L, def->stats.dropped);
+	lua_pushinteger(L, def->stats.retried);
+	return 2;
+}
+
+static int event_lua_arena(lua_State *L)
+{
+	ArenaStats stats[EVENT_ARENA_CLASSES];
+	unsigned heap = event_arena_stats(stats);
+	lua_settop(L, 0);
+	lua_createtable(L, EVENT_ARENA_CLASSES, 1);
+	int c;
+	for (c = 0; c < EVENT_ARENA_CLASSES; ++c) {
+		lua_createtable(L, 0, 4);
+		lua_pushinteger(L, stats[c].size);
+		lua_setfield(L, -2, "size");
+		lua_pushinteger(L, stats[c].blocks);
+		lua_setfield(L, -2, "blocks");
+		lua_pushinteger(L, stats[c].in_use);
+		lua_setfield(L, -2, "in_use");
+		lua_pushinteger(L, stats[c].high_water);
+		lua_setfield(L, -2, "high_water");
+		lua_rawseti(L, -2, c + 1);
+	}
+	lua_pushinteger(L, heap);
+	lua_setfield(L, -2, "heap");
+	return 1;
+}
+
+static int event_lua_stats(lua_State *L)
+{
+	EventStats stats;
+	if (lua_gettop(L) >= 1) {
+		int eventcode = lua_tointeger(L, 1);
+		lua_settop(L, 0);
+		if (!event_get_stats(eventcode, &stats))
+			return 0;
+		push_stats(L, &stats);
+		return 1;
+	}
+	// Without arguments, return the statistics of all events by name.
+	lua_createtable(L, 0, max_event);
+	int index;
+	for (index = 1; index < max_event; ++index) {
+		if (!event_get_stats(event_code_at(index), &stats))
+			continue;
+		push_stats(L, &stats);
+		lua_setfield(L, -2, event_defs[index].name);
+	}
+	return 1;
+}
+
+static void push_stats(lua_State *L, const EventStats *stats)
+{
+	lua_createtable(L, 0, 11);
+	lua_pushinteger(L, stats->sent);
+	lua_setfield(L, -2, "sent");
+	lua_pushinteger(L, stats->delivered);
+	lua_setfield(L, -2, "delivered");
+	lua_pushinteger(L, stats->dropped);
+	lua_setfield(L, -2, "dropped");
+	lua_pushinteger(L, stats->retried);
+	lua_setfield(L, -2, "retried");
+	lua_pushinteger(L, stats->coalesced);
+	lua_setfield(L, -2, "coalesced");
+	lua_pushinteger(L, stats->filtered);
+	lua_setfield(L, -2, "filtered");
+	lua_pushinteger(L, stats->max_depth);
+	lua_setfield(L, -2, "max_depth");
+	push_histogram(L, &stats->source);
+	lua_setfield(L, -2, "source");
+	push_histogram(L, &stats->queue);
+	lua_setfield(L, -2, "queue");
+	push_histogram(L, &stats->handler);
+	lua_setfield(L, -2, "handler");
+	push_histogram(L, &stats->total);
+	lua_setfield(L, -2, "total");
+}
+
+static void push_histogram(lua_State *L, const LatencyHistogram *histogram)
+{
+	lua_createtable(L, EVENT_LATENCY_BUCKETS, 1);
+	int b;
+	for (b = 0; b < EVENT_LATENCY_BUCKETS; ++b) {
+		lua_pushinteger(L, histogram->count[b]);
+		lua_rawseti(L, -2, b + 1);
+	}
+	lua_pushinteger(L, histogram->max);
+	lua_setfield(L, -2, "max");
+}
+
+static int event_lua_on(lua_State *L)
+{
+	ScriptTask *self = current_lua_thread;
+	int eventcode;
+	if (lua_isinteger(L, 1))
+		eventcode = lua_tointeger(L, 1);
+	else
+		eventcode = event_find(lua_tostring(L, 1));
+	if (event_get_name(eventcode) == NULL) {
+		printf(_("Invalid event for on\n"));
+		lua_settop(L, 0);
+		return 0;
+	}
+	// Handlers are per entry; they are removed when the event is deleted.
+	eventcode = EVENT_INDEX(eventcode);
+	if (!lua_isnil(L, 2) && !lua_isfunction(L, 2)) {
+		printf(_("Handler for on is not a function\n"));
+		lua_settop(L, 0);
+		return 0;
+	}
+	if (self->handlers[eventcode] != 0)
+		luaL_unref(L, LUA_REGISTRYINDEX, self->handlers[eventcode]);
+	self->handlers[eventcode] = 0;
+	if (lua_isfunction(L, 2)) {
+		lua_settop(L, 2);
+		self->handlers[eventcode] = luaL_ref(L, LUA_REGISTRYINDEX);
+	}
 	lua_settop(L, 0);
 	return 0;
 }
 
+static int event_lua_call(lua_State *L)
+{
+	ScriptTask *self = current_lua_thread;
+	if (!lua_istable(L, 1)) {
+		printf(_("Invalid argument for call\n"));
+		lua_settop(L, 0);
+		return 0;
+	}
+	int timeout = lua_isinteger(L, 2) ? lua_tointeger(L, 2) : -1;
+	Event request;
+	bool ok = marshal_event(L, 1, &request);
+	lua_settop(L, 0);
+	if (!ok)
+		return 0;
+	// The task index plus 1 is stored in the low 4 bits.
+	_Static_assert(MAX_TASKS < 16, "task index does not fit in call id");
+	self->next_call = (self->next_call + 1) & 0xfff;
+	request.call = self->next_call << 4 | ((self - tasks) + 1);
+	if (!event_send(&request))
+		return 0;
+	self->call = request.call;
+	self->call_timeout = timeout;
+	if (self->command) {
+		// Commands and handlers cannot yield, so wait here. The values go to
+		// the thread that called, which is not the script's thread in a
+		// handler.
+		return wait_reply(self, L);
+	}
+	// Only this coroutine waits; script_task or the executor resumes it with
+	// the reply.
+	return lua_yield(L, 0);
+}
+
+static int event_lua_send_at(lua_State *L)
+{
+	if (!lua_isinteger(L, 1) || !lua_istable(L, 2)) {
+		printf(_("Invalid arguments for send_at\n"));
+		lua_settop(L, 0);
+		return 0;
+	}
+	uint32_t time = lua_tointeger(L, 1);
+	Event event;
+	bool ok = marshal_event(L, 2, &event) &&
+		event_send_at(&event, time, current_lua_thread->queue);
+	lua_settop(L, 0);
+	lua_pushboolean(L, ok);
+	return 1;
+}
+
+static int event_lua_send_after(lua_State *L)
+{
+	if (!lua_isnumber(L, 1) || !lua_istable(L, 2)) {
+		printf(_("Invalid arguments for send_after\n"));
+		lua_settop(L, 0);
+		return 0;
+	}
+	// The delay is in ms, but may have a fraction.
+	lua_Number delay = lua_tonumber(L, 1);
+	uint32_t time = event_now() + (delay > 0 ? (uint32_t)(delay * 1000) : 0);
+	Event event;
+	bool ok = marshal_event(L, 2, &event) &&
+		event_send_at(&event, time, current_lua_thread->queue);
+	lua_settop(L, 0);
+	lua_pushboolean(L, ok);
+	return 1;
+}
+
+static int event_lua_timer(lua_State *L)
+{
+	int nargs = lua_gettop(L);
+	if (nargs < 2) {
+		printf(_("timer called with fewer than 2 arguments\n"));
+		lua_settop(L, 0);
+		return 0;
+	}
+	int eventcode;
+	if (lua_isinteger(L, 1))
+		eventcode = lua_tointeger(L, 1);
+	else
+		eventcode = event_find(lua_tostring(L, 1));
+	// The period is in ms, but may have a fraction.
+	lua_Number period = lua_tonumber(L, 2);
+	bool oneshot = lua_toboolean(L, 3);
+	lua_settop(L, 0);
+	uint64_t us = period > 0 ? (uint64_t)(period * 1000 + .5) : 0;
+	lua_pushboolean(L, event_timer(eventcode, us, oneshot,
+		current_lua_thread->queue));
+	return 1;
+}
+
+static int event_lua_record(lua_State *L)
+{
+	// Optional table of event names or codes to record; all by default.
+	int codes[MAX_EVENTS];
+	int num = 0;
+	bool all = !lua_istable(L, 1);
+	if (!all) {
+		int len = luaL_len(L, 1);
+		int n;
+		for (n = 1; n <= len && num < MAX_EVENTS; ++n) {
+			lua_geti(L, 1, n);
+			if (lua_isinteger(L, -1))
+				codes[num++] = lua_tointeger(L, -1);
+			else
+				codes[num++] = event_find(lua_tostring(L, -1));
+			lua_pop(L, 1);
+		}
+	}
+	size_t size = luaL_optinteger(L, 2, 0);
+	lua_settop(L, 0);
+	lua_pushboolean(L, record_start(size, all ? NULL : codes, num));
+	return 1;
+}
+
+static int event_lua_record_stop(lua_State *L)
+{
+	const char *path = lua_tostring(L, 1);
+	int ret = record_stop(path);
+	lua_settop(L, 0);
+	if (ret < 0)
+		return 0;
+	lua_pushinteger(L, ret);
+	return 1;
+}
+
+static int event_lua_replay(lua_State *L)
+{
+	int nargs = lua_gettop(L);
+	if (nargs < 1) {
+		printf(_("replay called without arguments\n"));
+		return 0;
+	}
+	const char *path = lua_tostring(L, 1);
+	bool fast = lua_toboolean(L, 2);
+	bool ret = replay_start(path, fast);
+	lua_settop(L, 0);
+	lua_pushboolean(L, ret);
+	return 1;
+}
+
+static int event_lua_now(lua_State *L)
+{
+	lua_settop(L, 0);
+	lua_pushinteger(L, event_now());
+	return 1;
+}
+
 static inline void dump_event(int eventcode)
 {
-	EventType *def = &event_defs[eventcode];
+	EventType *def = &event_defs[EVENT_INDEX(eventcode)];
 	printf(_("Event: %s\nInts (%d):"), def->name, def->num_int);
 	int t;
 	for (t = 0; t < 6; ++t) {
@@ -976,21 +3967,27 @@ static inline void dump_event(int eventcode)
 			printf(_(" %s"), def->s[t]);
 	}
 	printf(_("\n"));
-	if (def->raw)
-		printf(_("raw\n"));
 }
 
 char *print_event(Event *event)
 {
 	if (event == NULL)
 		return strdup("Attempt to print NULL event!");
-	if (event->eventcode < 0 || event->eventcode >= max_event ||
-		event_defs[event->eventcode].name == NULL) {
-		char *msg;
-		asprintf(&msg, "Attempt to print invalid event %d!", event->eventcode);
-		return msg;
-	}
-	EventType *def = &event_defs[event->eventcode];
+	// The names are freed if the event is deleted meanwhile.
+	unsigned epoch = event_registry_enter();
+	EventType *def = get_def(event->eventcode);
+	char *buffer;
+	if (def == NULL)
+		asprintf(&buffer, "Attempt to print invalid event %d!",
+			event->eventcode);
+	else
+		buffer = format_event(def, event);
+	event_registry_exit(epoch);
+	return buffer;
+}
+
+static char *format_event(const EventType *def, const Event *event)
+{
 	int i;
 	// +3 should be enough; use a bit more to be sure.
 	size_t nameslen = strlen(def->name) + 10;
@@ -41,6 +41,8 @@
 #define _(msg) msg
 
 #include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/ringbuf.h>
 #include <lua.h>
 
 // Defined in main.c (which doesn't have a header file).
@@ -52,18 +54,127 @@ void print_system_state(void);
 // Maximum number of tasks that can run simultaneously.
 #define MAX_TASKS 10
 
+// Largest capacity of the event queues of a Lua task, in slots. A slot has
+// room for an event with up to four parameters (32 bytes).
+#define MAX_QUEUE_LENGTH 1000
+
 // Maximum number of event types.
 #define MAX_EVENTS 100
 
+// An event code holds the index of its definition in event_defs in the low 8
+// bits, and the generation of that entry above them. The generation changes
+// when an event is deleted, so codes of deleted events are rejected even after
+// the entry is used again. Events that were never deleted have generation 0,
+// so their code is the index.
+#define EVENT_INDEX(code) ((code) & 0xff)
+#define EVENT_CODE(index, generation) ((index) | (generation) << 8)
+
+// Number of slots in the event name index. Must be a power of two, and larger
+// than MAX_EVENTS to keep the probe sequences short.
+#define EVENT_INDEX_SIZE 256
+
+// Entry of the event name index that belonged to a deleted event.
+#define EVENT_INDEX_DELETED 0xff
+
 // Maximum total size of single reply.
 #define REPLY_BUFFER_SIZE 500
 
+// Maximum number of coalesced events that can be pending at the same time.
+#define MAX_MAILBOXES 32
+
+// Maximum number of queues that can subscribe to one event, in addition to the
+// queue that claimed it.
+#define MAX_SUBSCRIBERS 4
+
+// Number of block sizes in the event string arena.
+#define EVENT_ARENA_CLASSES 3
+
+// Maximum number of events in one batch.
+#define MAX_BATCH 24
+
+// Maximum number of timers that send events.
+#define MAX_TIMERS 16
+
+// Maximum number of events that can be scheduled with event_send_at.
+#define MAX_SCHEDULED 48
+
+// Number of buckets in a latency histogram. Bucket n counts latencies below
+// 10^(n+1) microseconds; the last one counts all the rest.
+#define EVENT_LATENCY_BUCKETS 7
+
+// Flags for event_new.
+// Only the newest pending value of the event is delivered. Older values that
+// have not been received yet are overwritten instead of queued.
+#define EVENT_COALESCE 0x01
+// Like EVENT_COALESCE, but separately for every value of the first int
+// parameter (for example, a pin or channel number).
+#define EVENT_COALESCE_KEY 0x02
+
+// Tests of an event filter on an int parameter.
+typedef enum EventFilterTest {
+	EVENT_FILTER_ANY,	// No test.
+	EVENT_FILTER_EQUAL,	// The parameter equals value.
+	EVENT_FILTER_DIFFERENT,	// The parameter differs from value.
+	EVENT_FILTER_CHANGED,	// The parameter differs from the previous one.
+} EventFilterTest;
+
+// Filter of the claimer of an event. It is evaluated by the sender, so events
+// that do not pass it are not queued, and do not wake up the receiver.
+typedef struct EventFilter {
+	EventFilterTest test;
+	int field;	// Index of the int parameter that is tested.
+	int value;	// Value for EQUAL and DIFFERENT.
+	unsigned rate;	// Maximum number of events per second, or 0.
+	// State, used by the sender.
+	bool seen;	// Whether last is set.
+	int last;	// Last value of the field that passed, for CHANGED.
+	uint32_t window;	// Start of the current second, for the rate.
+	unsigned count;	// Number of events that passed in this second.
+} EventFilter;
+
+// How a Lua task receives an event from event.wait().
+typedef enum EventDelivery {
+	EVENT_DELIVER_PARSED,	// A new table with the parameters by name.
+	EVENT_DELIVER_RAW,	// A new table with the code and the parameters.
+	EVENT_DELIVER_VALUES,	// The code and the parameters as separate values.
+	EVENT_DELIVER_REUSE,	// Like RAW, but the same table every time.
+} EventDelivery;
+
+// Queue that receives events. Events are stored in a compact encoding, which
+// only contains the parameters that the event type uses.
+typedef RingbufHandle_t EventQueue;
+
 typedef struct ScriptTask {
-	QueueHandle_t queue;
+	char name[16];	// For reports.
+	EventQueue queue;
+	int queue_length;	// Capacity of queue, in 32 byte slots.
+	unsigned max_depth;	// Most events that were in queue.
+	EventQueue urgent;	// Lane for urgent claims, received first; or NULL.
+	int urgent_length;	// Capacity of urgent; 0 if there is no such lane.
+	unsigned urgent_max_depth;	// Most events that were in urgent.
+	QueueSetHandle_t lanes;	// Queue set of queue and urgent, or NULL.
 	lua_State *thread;
 	int ref;	// Ref in the registry for this thread object.
 	char *lua_file;	// Only used during startup.
+	uint32_t source_time;	// Time of the event or command that is handled.
+	EventQueue replies;	// Replies to event.call. Kept when the task ends.
+	uint16_t call;	// Call that the script waits for, or 0.
+	uint16_t next_call;	// Counter for call ids.
+	int call_timeout;	// Timeout of the call in ms; -1 for no timeout.
+	bool command;	// Running a command or handler, which cannot yield.
 	bool active;
+	lua_State *handler_thread;	// Thread that runs the handlers.
+	int handler_ref;	// Ref in the registry for handler_thread.
+	int handlers[MAX_EVENTS];	// Refs of event.on handlers, or 0.
+	uint8_t delivery[MAX_EVENTS];	// EventDelivery of every event it receives.
+	int event_table;	// Ref of the table for EVENT_DELIVER_REUSE.
+	// Used when the script runs in the Lua executor.
+	uint8_t state;	// What the script waits for.
+	bool timed;	// The wait ends at deadline.
+	uint32_t deadline;	// Time from event_now() when the wait ends.
+	uint16_t ready;	// Set entries that were credited to queue.
+	uint16_t urgent_ready;	// Set entries that were credited to urgent.
+	uint16_t replies_ready;	// Set entries that were credited to replies.
 } ScriptTask;
 
 typedef struct Event {
@@ -71,21 +182,95 @@ typedef struct Event {
 	int i[6];
 	float f[3];
 	const char *s[3];
+	uint32_t t;	// Time of the source, from event_now(); 0 if it is not known.
+	uint16_t call;	// Id of the call this is a request of or reply to, or 0.
+	bool more;	// More events of the same batch follow for this receiver.
 } Event;
 
+typedef struct LatencyHistogram {
+	unsigned count[EVENT_LATENCY_BUCKETS];
+	unsigned max;	// Longest latency, in microseconds.
+} LatencyHistogram;
+
+// Runtime statistics of an event type. The counters are updated without locks;
+// they are only for monitoring.
+typedef struct EventStats {
+	unsigned sent;	// Number of times the event was sent.
+	unsigned delivered;	// Number of times a receiver got it; once per receiver.
+	unsigned dropped;	// Number of times a receiver had no room for it.
+	unsigned retried;	// Number of times a sender waited for room.
+	unsigned coalesced;	// Number of values that were overwritten.
+	unsigned filtered;	// Number of times the filter of the claimer rejected it.
+	unsigned max_depth;	// Most items in a receiving queue, including this one.
+	// Latency of every stage that an event goes through. Source and total are
+	// only recorded for events with a source time.
+	LatencyHistogram source;	// From the source until it is queued.
+	LatencyHistogram queue;	// Time in the queue.
+	LatencyHistogram handler;	// From receiving it until it is handled.
+	LatencyHistogram total;	// From the source until it is handled.
+} EventStats;
+
 // Mostly for internal use, but also used by interrupt handlers.
 typedef struct EventType {
 	const char *name;
+	uint32_t hash;	// Hash of name, for the name index.
 	int num_float, num_int, num_str;
 	const char *i[6];
 	const char *f[3];
 	const char *s[3];
-	QueueHandle_t queue;
-	bool raw;
+	EventQueue queue;
+	EventQueue subscribers[MAX_SUBSCRIBERS];	// NULL for unused entries.
+	int keys;	// Ref of a Lua table with the interned names, or 0.
+	uint8_t generation;	// Changed when the event is deleted.
+	const ScriptTask *owner;	// Lua task that defined it, or NULL.
+	unsigned flags;
+	EventFilter filter;	// Filter for queue; test ANY and rate 0 if unused.
+	EventStats stats;
 } EventType;
 
 extern EventType event_defs[MAX_EVENTS];
 
+/// @brief Compute the hash of an event name, as used by the name index.
+/// @param name The event name.
+/// @return The hash value.
+uint32_t event_hash(const char *name);
+
+/// @brief Look up a name in an event name index.
+/// This is used by event_find; it is exported for benchmarking.
+/// @param index The index, EVENT_INDEX_SIZE slots of indices in defs (0 is
+/// empty).
+/// @param defs The event definitions that the index refers to.
+/// @param name The name to look up.
+/// @param hash The hash of name, as computed by event_hash.
+/// @return The index in defs, or 0 if it was not found.
+int event_index_find(const uint8_t *index, const EventType *defs,
+	const char *name, uint32_t hash);
+
+/// @brief Add an event definition to an event name index.
+/// If the name is already in the index, the index is not changed.
+/// @param index The index, EVENT_INDEX_SIZE slots of indices in defs (0 is
+/// empty).
+/// @param defs The event definitions that the index refers to.
+/// @param eventcode The index of the event to add. Its name and hash must be
+/// set.
+/// @return False if the index is full.
+bool event_index_add(uint8_t *index, const EventType *defs, int eventcode);
+
+/// @brief Remove an event definition from an event name index.
+/// @param index The index.
+/// @param defs The event definitions that the index refers to.
+/// @param eventcode The index of the event to remove. Its name and hash must
+/// still be set.
+void event_index_remove(uint8_t *index, const EventType *defs, int eventcode);
+
+// Usage of one block size of the event string arena.
+typedef struct ArenaStats {
+	size_t size;	// Block size, including the nul byte.
+	int blocks;	// Number of blocks.
+	int in_use;	// Number of blocks currently in use.
+	int high_water;	// Maximum number of blocks that were in use.
+} ArenaStats;
+
 typedef void (*ReplyCb)(const char *msg, size_t size, void *user_data);
 
 /// @brief Initialize the event system.
@@ -99,16 +284,40 @@ bool event_start();
 
 /// @brief Claim an event for the given queue.
 /// @param eventcode The event to claim.
-/// @param raw Whether the parameters are parsed. Only used by Lua tasks.
+/// @param delivery How the event is passed to Lua. Only used by Lua tasks.
 /// @param queue The queue to send it to.
 /// @return False in case of error.
-bool event_claim(int eventcode, bool raw, QueueHandle_t queue);
+bool event_claim(int eventcode, EventDelivery delivery, EventQueue queue);
+
+/// @brief Set the filter of the claimer of an event.
+/// Subscribers are not filtered. The filter is removed when the event is
+/// released.
+/// @param eventcode The event, which must be claimed.
+/// @param filter The filter; its state is reset. NULL removes the filter.
+/// @return False in case of error.
+bool event_filter(int eventcode, const EventFilter *filter);
 
 /// @brief Release an event, to be claimed by another queue.
 /// @param eventcode The event to release.
 /// @return False in case of error.
 bool event_release(int eventcode);
 
+/// @brief Subscribe a queue to an event.
+/// Unlike claiming, any number of queues (up to MAX_SUBSCRIBERS) can subscribe
+/// to the same event. Every subscriber receives every event that is sent.
+/// @param eventcode The event to subscribe to.
+/// @param delivery How the event is passed to Lua. Only used by Lua tasks.
+/// Every receiving task has its own.
+/// @param queue The queue to send it to.
+/// @return False in case of error.
+bool event_subscribe(int eventcode, EventDelivery delivery, EventQueue queue);
+
+/// @brief Remove a subscription.
+/// @param eventcode The event to unsubscribe from.
+/// @param queue The queue that was subscribed.
+/// @return False in case of error.
+bool event_unsubscribe(int eventcode, EventQueue queue);
+
 /// @brief Look up event code.
 /// @param name The event name to look up.
 /// @return The event code, or 0 if it was not found.
@@ -119,42 +328,243 @@ int event_find(const char *name);
 /// @return The event name, or NULL if it is not defined.
 const char *event_get_name(int eventcode);
 
+/// @brief Start reading event definitions.
+/// The names of an event are freed when it is deleted. Until the matching
+/// event_registry_exit, the names of definitions that were found stay valid.
+/// Do not block in between; event_delete waits for it.
+/// @return The value to pass to event_registry_exit.
+unsigned event_registry_enter();
+
+/// @brief Stop reading event definitions.
+/// @param epoch The value that event_registry_enter returned.
+void event_registry_exit(unsigned epoch);
+
+/// @brief Get the code of the event that is defined at an index in event_defs.
+/// This is for iterating over all events.
+/// @param index The index, from 1 to MAX_EVENTS - 1.
+/// @return The event code, or 0 if nothing is defined at index.
+int event_code_at(int index);
+
 /// @brief Define a new event. It is not claimed.
 /// @param name The name of the new event. This must not be defined yet.
 /// @param f The 3 names of float parameters, or NULL if they are not used.
 /// @param i The 3 names of int parameters, or NULL if they are not used.
 /// @param s The 3 names of string parameters, or NULL if they are not used.
-/// @return The new event code, or 0 in case of error.
+/// @param flags EVENT_COALESCE, EVENT_COALESCE_KEY or 0.
+/// @return The new event code, or 0 in case of error, for example if an
+/// event with the same name exists.
 int event_new(const char *name, const char *i[6], const char *f[3],
-	const char *s[3]);
+	const char *s[3], unsigned flags);
+
+/// @brief Delete an event that a Lua task defined.
+/// Its claim and subscriptions end, and its code is no longer valid: sending
+/// it fails, and events of it that are still queued are dropped. The entry in
+/// event_defs is used again by a later event_new, with a new code. Only call
+/// this from a Lua task.
+/// @param eventcode The event to delete.
+/// @return False if it is not defined, or was not defined by a Lua task.
+bool event_delete(int eventcode);
 
 /// @brief Send an event.
+/// The event is delivered to the queue that claimed it and to all subscribers.
+/// They share the string parameters; those are freed when every receiver has
+/// called event_free.
 /// @param event The event to send.
-/// @return False if the event did not exist, was not claimed, or another error
-/// was encountered.
+/// @return False if the event did not exist, had no receivers, or could not be
+/// delivered to any of them.
 bool event_send(const Event *event);
 
+/// @brief Send an event, but do not free it if it cannot be delivered.
+/// Unlike event_send, this allows the caller to send the event again later.
+/// @param event The event to send.
+/// @return False if the event did not exist, had no receivers, or none of
+/// them had room for it. In that case, the event is still owned by the caller.
+bool event_try_send(const Event *event);
+
+/// @brief Send an event, waiting for room in the receiving queues.
+/// Every receiver that is full is waited for, until the timeout expires. The
+/// event is not freed if it cannot be delivered.
+/// @param event The event to send.
+/// @param timeout The maximum time to wait, in milliseconds.
+/// @return False if the event did not exist, had no receivers, or none of
+/// them had room for it before the timeout. In that case, the event is still
+/// owned by the caller.
+bool event_send_timeout(const Event *event, int timeout);
+
+/// @brief Send several events at once.
+/// Either all events are queued, or (if a receiver does not have room for its
+/// part of the batch, or an event has no receivers) none of them are. Every
+/// receiver gets its events with more set, except the last one. This allows it
+/// to act on the batch as a whole, for example to update all LEDs at once.
+/// @param events The events to send. On failure, they are freed.
+/// @param num The number of events, at most MAX_BATCH.
+/// @return False if the batch was not sent.
+bool event_send_batch(Event *events, int num);
+
+/// @brief Send an event from an interrupt handler.
+/// The event must not have string parameters. It is not coalesced.
+/// @param event The event to send.
+/// @return False if the event did not exist, had no receivers, or could not be
+/// delivered to any of them.
+bool event_send_from_isr(const Event *event);
+
+/// @brief Send the reply to a request.
+/// Drivers that send a reply event use this. If the request was made with
+/// event.call, the reply goes straight to the caller, as a "reply" event;
+/// otherwise it is sent normally, to reply->eventcode.
+/// @param request The request that this is a reply to.
+/// @param reply The reply. Its int parameters are the returned values.
+/// @return False if the reply could not be delivered.
+bool event_reply(const Event *request, Event *reply);
+
+/// @brief Send an event at a later time.
+/// The event is kept in a timing wheel with a resolution of 1 ms, and sent by
+/// the wheel task when it is due. Events that are due at the same time are
+/// sent in the order in which they were scheduled. The source time of the
+/// event is set to the requested time.
+/// @param event The event to send. It is freed if it cannot be scheduled.
+/// @param time The time to send it, from event_now(). If it is in the past,
+/// the event is sent as soon as possible. It must be at most 35 minutes
+/// in the future.
+/// @param owner The queue of the task that schedules it, or NULL. Its events
+/// are dropped when the task ends, like its timers.
+/// @return False if too many events are scheduled.
+bool event_send_at(const Event *event, uint32_t time, EventQueue owner);
+
+/// @brief Send an event periodically, or once after a delay.
+/// The event is sent from the esp_timer task, with the time when the timer
+/// fired as source time. Periodic timers do not drift. Only the event code is
+/// set; other parameters are 0.
+/// @param eventcode The event to send. There is one timer per event; calling
+/// this again for the same event replaces the previous settings.
+/// @param period The period (or delay) in microseconds. If 0, the timer is
+/// stopped.
+/// @param oneshot Whether the event is sent only once.
+/// @param owner The timer is stopped when this queue is deleted by a Lua task.
+/// @return False in case of error.
+bool event_timer(int eventcode, uint64_t period, bool oneshot,
+	EventQueue owner);
+
+/// @brief Create a queue for receiving events.
+/// @param length The number of events with up to 4 parameters that fit in the
+/// queue. Events with more parameters use more space.
+/// @return The new queue, or NULL in case of error.
+EventQueue event_queue_create(int length);
+
+/// @brief Get the most events that can be in a queue at the same time.
+/// Events without parameters take half the space of an event with 4, so a
+/// queue set for event queues needs this many entries for each of them.
+/// @param length The length that the queue was created with.
+/// @return The number of events.
+int event_queue_max_items(int length);
+
+/// @brief Delete an event queue. Pending events in it are freed.
+/// @param queue The queue to delete.
+void event_queue_delete(EventQueue queue);
+
+/// @brief Put an event in a queue, without looking at claims or subscriptions.
+/// Normally event_send should be used instead.
+/// @param queue The queue to send the event to.
+/// @param event The event to send. It is not freed on failure.
+/// @return False if the queue is full.
+bool event_queue_send(EventQueue queue, const Event *event);
+
 /// @brief Wait for an event.
 /// @param timeout The timeout in milliseconds.
 /// @param event The event that is received.
 /// @param queue The queue to listen on.
 /// @return False if the timeout expired. In that case *event is not changed.
-bool event_wait(int timeout, Event *event, QueueHandle_t queue);
+bool event_wait(int timeout, Event *event, EventQueue queue);
 
 /// @brief Free allocated members (strings).
 /// @param event The event to free.
 /// @return False in case of error.
 bool event_free(Event *event);
 
+/// @brief Copy a string for use as event parameter.
+/// The copy is taken from the event string arena, so this normally does not
+/// use the heap. Only if the arena is full, or the string is too long for it,
+/// the heap is used. It is freed by event_free.
+/// @param str The string to copy.
+/// @param len The length of str, not including the nul byte.
+/// @return The copy, or NULL in case of error.
+const char *event_strdup(const char *str, size_t len);
+
+/// @brief Get usage statistics of the event string arena.
+/// @param stats Array of EVENT_ARENA_CLASSES entries that is filled in.
+/// @return The number of strings that were stored on the heap instead.
+unsigned event_arena_stats(ArenaStats stats[EVENT_ARENA_CLASSES]);
+
+/// @brief Get the runtime statistics of an event type.
+/// @param eventcode The event to get the statistics for.
+/// @param stats The statistics are copied here.
+/// @return False if the event is not defined.
+bool event_get_stats(int eventcode, EventStats *stats);
+
+/// @brief Print the statistics of all event types on the console.
+void event_print_stats();
+
+/// @brief Get the current time, for use as source time of an event.
+/// This can be called from interrupt handlers.
+/// @return The time in microseconds. It wraps around, but is never 0.
+uint32_t event_now();
+
+/// @brief Record that a received event has been handled, for the statistics.
+/// @param event The event that was handled.
+/// @param start The time when it was received, from event_now().
+void event_handled(const Event *event, uint32_t start);
+
+/// @brief Push a received event on a Lua stack, as event.wait() returns it.
+/// This is used by script tasks; it is exported for benchmarking.
+/// @param L The Lua thread.
+/// @param event The event. Its strings are copied, not freed.
+/// @param delivery How the event is passed.
+/// @param table Ref of the table that is reused for EVENT_DELIVER_REUSE.
+/// @return The number of values that were pushed.
+int event_push(lua_State *L, const Event *event, EventDelivery delivery,
+	int table);
+
+/// @brief Push the Lua table with the interned parameter names of an event.
+/// It has the float, int and string names, followed by the event name. Only
+/// call this from a Lua task.
+/// @param L The Lua thread.
+/// @param def The event definition. Its table is created on first use.
+void event_push_keys(lua_State *L, EventType *def);
+
 /// @brief Create a new Lua coroutine.
 /// This is used by launch_lua_task and to create other Lua contexts,
 /// for example in the Cli.
-ScriptTask *create_lua_task();
+/// @param name The name of the task in reports.
+/// @param queue_length Capacity of the event queue, in 32 byte slots, up to
+/// MAX_QUEUE_LENGTH. A slot holds an event with up to four parameters; larger
+/// events take up to 2.25 slots, and events without parameters half a slot.
+/// 0 for the default.
+/// @param urgent_length Capacity of a second queue for urgent claims, which
+/// is received from first; 0 for none.
+/// @return The task, or NULL if a length is invalid or memory ran out.
+ScriptTask *create_lua_task(const char *name, int queue_length,
+	int urgent_length);
 
 /// @brief Launch a new FreeRTOS task that runs a Lua coroutine.
 /// @param lua_file The Lua code to run in the coroutine.
+/// @param queue_length Capacity of the event queue; 0 for the default.
+/// @param urgent_length Capacity of the urgent queue; 0 for none.
 /// @return False in case of error.
-ScriptTask *launch_lua_task(const char *lua_file);
+ScriptTask *launch_lua_task(const char *lua_file, int queue_length,
+	int urgent_length);
+
+/// @brief Wait for an event for a Lua task.
+/// Events in the urgent queue are received first. The depth of the queues is
+/// recorded for event_print_tasks.
+/// @param self The task.
+/// @param timeout The maximum time to wait in ms, or -1 to wait forever.
+/// @param event The event that is received.
+/// @return False if the timeout expired.
+bool event_task_wait(ScriptTask *self, int timeout, Event *event);
+
+/// @brief Print the queue capacity and high-water mark of every Lua task on
+/// the console.
+void event_print_tasks();
 
 /// @brief Set enum constants in lua; for use by device drivers.
 /// @param tablename The name of the new global variable in Lua.
@@ -0,0 +1,399 @@
+/*
+ * # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # #
+ * #                                                                         #
+ * #                              +@@+    .-++-------=*=.                    #
+ * #                             +%%@+-------------------+                   #
+ * #                            =@@+*=---------------------==                #
+ * #                         .%+-=@%*+=----------------------=*.             #
+ * #                        =%---=@=***-------------------------+.           #
+ * #                       .%----=@%#=+%=------------------------*           #
+ * #                        *+---=@**#%-#=----------+:*------------          #
+ * #                        .#+--=@%%#++++=-------+: :*-----------*          #
+ * #                           +##@%#%%%#=#=----*:..:*------------#.         #
+ * #             **%@@@@@@@#+-.                    -=------------+           #
+ * #       .*@%+.         .                       =------------==            #
+ * #    =@=.....         =@+=%%   +@   --        :*-------------             #
+ * #   @*........                 .#@@@-          +------------=:            #
+ * #   @=.......                                  -+---------------++*.      #
+ * #   *%-...-%@.                     ...         .=------------------:      #
+ * #     -@@=...                                   .+----------------#       #
+ * #        =#@%+-..                               ..+-------------=.        #
+ * #                  .:-=*#%%%@@@:                ...=----------+:  +=+:    #
+ * #                            +%                  ...+---------= .-----:   #
+ * #                           :@.                   ...++--------------+    #
+ * #                           %*                     ....+@%#-----%+        #
+ * #                          :@.                      .....+@:              #
+ * #                                                                         #
+ * # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # #
+ * # NAME       = Event recorder and replayer                                #
+ * # PROJECT    = Beursgadget 2025 - Circuit-Cruiser                         #
+ * # DATE       = 17-10-2026                                                 #
+ * # AUTHOR     = Bas Wijnen & Jan-Cees Tjepkema                             #
+ * # WEBSITE    = https://pinkfluffyunicorns.nl                              #
+ * # COPYRIGHT(C) Pink Fluffy Unicorns 2025                                  #
+ * # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # #
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <esp_timer.h>
+#include "event.h"
+#include "record.h"
+
+// Version of the file format. Change it when the format changes.
+#define RECORD_VERSION 2
+
+// Start of a recording file. It is followed by size bytes of entries. Every
+// entry is:
+//   u32 time in µs since the start of the recording, u16 event code, u8 counts
+//   (num_int in bits 0-2, num_float in bits 3-4, num_str in bits 5-6), u8
+//   flags, then for ENTRY_NAMED the name of the event (a length byte,
+//   followed by that many characters), then the ints (i32), floats (f32) and
+//   strings (u16 length + bytes).
+// The first entry of every event code has its name, which is taken when the
+// event is sent. A code whose event is deleted during the recording keeps its
+// name, and an entry that is used again gets a new code with a new name.
+// All values are little endian, as stored by the ESP32.
+typedef struct RecordHeader {
+	char magic[4];	// "EVRC"
+	uint16_t version;
+	uint16_t reserved;	// 0.
+	uint32_t num_entries;
+	uint32_t size;
+} RecordHeader;
+
+// Size of an entry without its name and parameters.
+#define ENTRY_HEADER 8
+
+// Flags of an entry.
+#define ENTRY_NAMED 0x01	// The name of the event follows the header.
+
+bool record_active;
+
+static portMUX_TYPE record_lock = portMUX_INITIALIZER_UNLOCKED;
+static uint8_t *buffer;	// Entries; NULL if there is no recording.
+static size_t buffer_size;
+static size_t used;	// Bytes of buffer that are used.
+static uint32_t num_entries;
+static uint32_t start_time;	// event_now() when the recording started.
+static bool record_all;	// Record every event, instead of the selected ones.
+static uint16_t selected[MAX_EVENTS];	// Code to record by index, or 0.
+static uint16_t named[MAX_EVENTS];	// Code whose name was recorded, by index.
+
+static bool replaying;	// Whether a replay task is running.
+
+static void replay_task(void *arg);
+static bool write_all(FILE *file, const void *data, size_t size);
+
+void record_add(const Event *event)
+{
+	// Senders call this while they use the definition, so the name cannot be
+	// freed before it is copied.
+	int code = EVENT_INDEX(event->eventcode);
+	const char *name = event_get_name(event->eventcode);
+	if (name == NULL || (!record_all && selected[code] != event->eventcode))
+		return;
+	const EventType *def = &event_defs[code];
+	uint8_t name_len = strnlen(name, 255);
+	size_t size = ENTRY_HEADER + 4 * (def->num_int + def->num_float);
+	size_t len[3] = { 0, 0, 0 };
+	int n;
+	for (n = 0; n < def->num_str; ++n) {
+		len[n] = event->s[n] == NULL ? 0 : strlen(event->s[n]);
+		size += 2 + len[n];
+	}
+	uint32_t t = event_now() - start_time;
+	uint16_t code16 = event->eventcode;
+	uint8_t counts[2] = {
+		def->num_int | def->num_float << 3 | def->num_str << 5, 0
+	};
+	portENTER_CRITICAL_SAFE(&record_lock);
+	if (named[code] != code16) {
+		counts[1] = ENTRY_NAMED;
+		size += 1 + name_len;
+	}
+	if (!record_active || used + size > buffer_size) {
+		// Full; the recording ends here, so it has no gaps.
+		record_active = false;
+		portEXIT_CRITICAL_SAFE(&record_lock);
+		return;
+	}
+	uint8_t *p = &buffer[used];
+	memcpy(p, &t, 4);
+	memcpy(p + 4, &code16, 2);
+	memcpy(p + 6, counts, 2);
+	p += ENTRY_HEADER;
+	if (counts[1] & ENTRY_NAMED) {
+		*p = name_len;
+		memcpy(p + 1, name, name_len);
+		p += 1 + name_len;
+		named[code] = code16;
+	}
+	memcpy(p, event->i, 4 * def->num_int);
+	p += 4 * def->num_int;
+	memcpy(p, event->f, 4 * def->num_float);
+	p += 4 * def->num_float;
+	for (n = 0; n < def->num_str; ++n) {
+		uint16_t len16 = len[n];
+		memcpy(p, &len16, 2);
+		if (len[n] > 0)
+			memcpy(p + 2, event->s[n], len[n]);
+		p += 2 + len[n];
+	}
+	used += size;
+	++num_entries;
+	portEXIT_CRITICAL_SAFE(&record_lock);
+}
+
+bool record_start(size_t size, const int *codes, int num)
+{
+	if (buffer != NULL) {
+		printf(_("A recording is already active\n"));
+		return false;
+	}
+	if (size == 0)
+		size = RECORD_DEFAULT_SIZE;
+	uint8_t *new_buffer = malloc(size);
+	if (new_buffer == NULL) {
+		printf(_("Not enough memory for recording\n"));
+		return false;
+	}
+	record_all = codes == NULL;
+	memset(selected, 0, sizeof(selected));
+	memset(named, 0, sizeof(named));
+	int n;
+	for (n = 0; codes != NULL && n < num; ++n) {
+		int code = EVENT_INDEX(codes[n]);
+		if (code >= 1 && code < MAX_EVENTS)
+			selected[code] = codes[n];
+	}
+	buffer = new_buffer;
+	buffer_size = size;
+	used = 0;
+	num_entries = 0;
+	start_time = event_now();
+	__atomic_store_n(&record_active, true, __ATOMIC_RELEASE);
+	return true;
+}
+
+int record_stop(const char *path)
+{
+	if (buffer == NULL)
+		return -1;
+	portENTER_CRITICAL_SAFE(&record_lock);
+	record_active = false;
+	portEXIT_CRITICAL_SAFE(&record_lock);
+	int result = num_entries;
+	if (path != NULL) {
+		FILE *file = fopen(path, "wb");
+		if (file == NULL) {
+			printf(_("Unable to create %s\n"), path);
+			result = -1;
+		} else {
+			RecordHeader header = {
+				.magic = { 'E', 'V', 'R', 'C' },
+				.version = RECORD_VERSION,
+				.num_entries = num_entries,
+				.size = used,
+			};
+			bool ok = write_all(file, &header, sizeof(header)) &&
+				write_all(file, buffer, used);
+			if (fclose(file) != 0 || !ok) {
+				printf(_("Unable to write %s\n"), path);
+				result = -1;
+			}
+		}
+	}
+	free(buffer);
+	buffer = NULL;
+	return result;
+}
+
+static bool write_all(FILE *file, const void *data, size_t size)
+{
+	return fwrite(data, 1, size, file) == size;
+}
+
+// State of a replay, owned by replay_task.
+typedef struct Replay {
+	uint8_t *data;	// Entries.
+	size_t size;
+	uint32_t num_entries;
+	int map[MAX_EVENTS];	// Codes of this firmware by recorded index; 0 skips.
+	bool fast;
+	esp_timer_handle_t timer;	// Wakes the task for the next event.
+	TaskHandle_t task;
+} Replay;
+
+static void replay_wake(void *arg);
+
+bool replay_start(const char *path, bool fast)
+{
+	if (__atomic_exchange_n(&replaying, true, __ATOMIC_ACQ_REL)) {
+		printf(_("A replay is already running\n"));
+		return false;
+	}
+	Replay *replay = calloc(1, sizeof(Replay));
+	FILE *file = fopen(path, "rb");
+	RecordHeader header;
+	bool ok = replay != NULL && file != NULL &&
+		fread(&header, sizeof(header), 1, file) == 1 &&
+		memcmp(header.magic, "EVRC", 4) == 0 &&
+		header.version == RECORD_VERSION;
+	if (ok) {
+		replay->data = malloc(header.size);
+		ok = replay->data != NULL &&
+			fread(replay->data, 1, header.size, file) == header.size;
+	}
+	if (file != NULL)
+		fclose(file);
+	if (!ok) {
+		printf(_("Unable to read recording %s\n"), path);
+		if (replay != NULL)
+			free(replay->data);
+		free(replay);
+		__atomic_store_n(&replaying, false, __ATOMIC_RELEASE);
+		return false;
+	}
+	replay->size = header.size;
+	replay->num_entries = header.num_entries;
+	replay->fast = fast;
+	if (pdPASS != xTaskCreate(&replay_task, "replay", 4096, replay, 1,
+		NULL)) {
+		free(replay->data);
+		free(replay);
+		__atomic_store_n(&replaying, false, __ATOMIC_RELEASE);
+		return false;
+	}
+	return true;
+}
+
+static void replay_task(void *arg)
+{
+	Replay *replay = arg;
+	replay->task = xTaskGetCurrentTaskHandle();
+	esp_timer_create_args_t args = {
+		.callback = &replay_wake,
+		.arg = replay,
+		.dispatch_method = ESP_TIMER_TASK,
+		.name = "replay",
+	};
+	if (!replay->fast && ESP_OK != esp_timer_create(&args, &replay->timer))
+		replay->timer = NULL;
+	unsigned sent = 0;
+	unsigned skipped = 0;
+	unsigned failed = 0;
+	uint32_t start = event_now();
+	size_t pos = 0;
+	const uint8_t *end = replay->data + replay->size;
+	bool corrupt = false;
+	while (pos + ENTRY_HEADER <= replay->size) {
+		// The file may be corrupt or from other firmware, so every field is
+		// checked before it is read.
+		const uint8_t *p = &replay->data[pos];
+		uint32_t t;
+		uint16_t code;
+		memcpy(&t, p, 4);
+		memcpy(&code, p + 4, 2);
+		int num_int = p[6] & 7;
+		int num_float = (p[6] >> 3) & 3;
+		int num_str = (p[6] >> 5) & 3;
+		int index = EVENT_INDEX(code);
+		bool has_name = p[7] & ENTRY_NAMED;
+		p += ENTRY_HEADER;
+		if (index >= MAX_EVENTS || num_int > 6) {
+			corrupt = true;
+			break;
+		}
+		if (has_name) {
+			// Map the recorded code to this firmware by name. Later entries
+			// with this index have this code, until another name follows.
+			char name[256];
+			if (end - p < 1 || end - p < 1 + *p) {
+				corrupt = true;
+				break;
+			}
+			uint8_t len = *p;
+			memcpy(name, p + 1, len);
+			name[len] = '\0';
+			p += 1 + len;
+			replay->map[index] = event_find(name);
+		}
+		if (end - p < 4 * (num_int + num_float)) {
+			corrupt = true;
+			break;
+		}
+		Event event = { 0, };
+		memcpy(event.i, p, 4 * num_int);
+		p += 4 * num_int;
+		memcpy(event.f, p, 4 * num_float);
+		p += 4 * num_float;
+		const uint8_t *strings[3];
+		uint16_t len[3];
+		int n;
+		for (n = 0; n < num_str; ++n) {
+			if (end - p < 2)
+				break;
+			memcpy(&len[n], p, 2);
+			if (end - p < 2 + len[n])
+				break;
+			strings[n] = p + 2;
+			p += 2 + len[n];
+		}
+		if (n < num_str) {
+			corrupt = true;
+			break;
+		}
+		pos = p - replay->data;
+		event.eventcode = replay->map[index];
+		const EventType *def = &event_defs[EVENT_INDEX(event.eventcode)];
+		if (event.eventcode == 0 || def->num_int != num_int ||
+			def->num_float != num_float || def->num_str != num_str) {
+			++skipped;
+			continue;
+		}
+		int32_t wait = t - (event_now() - start);
+		if (!replay->fast && wait > 0) {
+			// Keep the original timing. A timer wakes the task more precisely
+			// than a tick; without one, the wait is rounded up to ticks.
+			if (replay->timer != NULL &&
+				ESP_OK == esp_timer_start_once(replay->timer, wait))
+				ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+			else
+				vTaskDelay((wait + 1000 * portTICK_PERIOD_MS - 1) /
+					(1000 * portTICK_PERIOD_MS));
+		}
+		for (n = 0; n < num_str; ++n)
+			event.s[n] = event_strdup((const char *)strings[n], len[n]);
+		// The replay is the source of the event.
+		event.t = event_now();
+		if (event_send(&event))
+			++sent;
+		else
+			++failed;
+	}
+	if (corrupt)
+		printf(_("Recording is corrupt; replay stopped\n"));
+	uint32_t elapsed = event_now() - start;
+	printf(_("Replay done: %u sent, %u not delivered, %u skipped in %lu us"),
+		sent, failed, skipped, (unsigned long)elapsed);
+	if (elapsed > 0)
+		printf(_(" (%lu events/s)"),
+			(unsigned long)((uint64_t)sent * 1000000 / elapsed));
+	printf("\n");
+	if (replay->timer != NULL)
+		esp_timer_delete(replay->timer);
+	free(replay->data);
+	free(replay);
+	__atomic_store_n(&replaying, false, __ATOMIC_RELEASE);
+	vTaskDelete(NULL);
+}
+
+static void replay_wake(void *arg)
+{
+	Replay *replay = arg;
+	xTaskNotifyGive(replay->task);
+}
@@ -0,0 +1,86 @@
+/*
+ * # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # #
+ * #                                                                         #
+ * #                              +@@+    .-++-------=*=.                    #
+ * #                             +%%@+-------------------+                   #
+ * #                            =@@+*=---------------------==                #
+ * #                         .%+-=@%*+=----------------------=*.             #
+ * #                        =%---=@=***-------------------------+.           #
+ * #                       .%----=@%#=+%=------------------------*           #
+ * #                        *+---=@**#%-#=----------+:*------------          #
+ * #                        .#+--=@%%#++++=-------+: :*-----------*          #
+ * #                           +##@%#%%%#=#=----*:..:*------------#.         #
+ * #             **%@@@@@@@#+-.                    -=------------+           #
+ * #       .*@%+.         .                       =------------==            #
+ * #    =@=.....         =@+=%%   +@   --        :*-------------             #
+ * #   @*........                 .#@@@-          +------------=:            #
+ * #   @=.......                                  -+---------------++*.      #
+ * #   *%-...-%@.                     ...         .=------------------:      #
+ * #     -@@=...                                   .+----------------#       #
+ * #        =#@%+-..                               ..+-------------=.        #
+ * #                  .:-=*#%%%@@@:                ...=----------+:  +=+:    #
+ * #                            +%                  ...+---------= .-----:   #
+ * #                           :@.                   ...++--------------+    #
+ * #                           %*                     ....+@%#-----%+        #
+ * #                          :@.                      .....+@:              #
+ * #                                                                         #
+ * # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # #
+ * # NAME       = Event recorder and replayer                                #
+ * # PROJECT    = Beursgadget 2025 - Circuit-Cruiser                         #
+ * # DATE       = 17-10-2026                                                 #
+ * # AUTHOR     = Bas Wijnen & Jan-Cees Tjepkema                             #
+ * # WEBSITE    = https://pinkfluffyunicorns.nl                              #
+ * # COPYRIGHT(C) Pink Fluffy Unicorns 2025                                  #
+ * # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # #
+ */
+
+#ifndef RECORD_H
+#define RECORD_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "event.h"
+
+// Size of the recording buffer if none is given.
+#define RECORD_DEFAULT_SIZE (16 * 1024)
+
+// Whether events are being recorded; use record_event instead of reading it.
+extern bool record_active;
+
+/// @brief Add a sent event to the recording. Use record_event instead.
+/// @param event The event.
+void record_add(const Event *event);
+
+/// @brief Add a sent event to the recording, if it is active.
+/// This does not block, and can be called from interrupt handlers.
+/// @param event The event.
+static inline void record_event(const Event *event)
+{
+	if (__atomic_load_n(&record_active, __ATOMIC_RELAXED))
+		record_add(event);
+}
+
+/// @brief Start recording events in RAM.
+/// @param size The size of the buffer in bytes; 0 for RECORD_DEFAULT_SIZE.
+/// When it is full, recording stops.
+/// @param codes The events to record, or NULL to record all events.
+/// @param num The number of entries in codes.
+/// @return False if a recording is active, or in case of error.
+bool record_start(size_t size, const int *codes, int num);
+
+/// @brief Stop recording and save the recording.
+/// @param path The file to write, or NULL to discard the recording.
+/// @return The number of events that were recorded, or -1 in case of error.
+int record_stop(const char *path);
+
+/// @brief Replay a recording in a new task.
+/// Events are matched by name, so the recording can be replayed on other
+/// firmware versions. Events that are not defined, or have other parameters,
+/// are skipped. A summary is printed on the console when it is done.
+/// @param path The recording.
+/// @param fast If true, events are sent as fast as possible, instead of with
+/// their original timing.
+/// @return False if a replay is running, or in case of error.
+bool replay_start(const char *path, bool fast);
+
+#endif
@@ -0,0 +1,231 @@
+/*
+ * # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # #
+ * #                                                                         #
+ * #                              +@@+    .-++-------=*=.                    #
+ * #                             +%%@+-------------------+                   #
+ * #                            =@@+*=---------------------==                #
+ * #                         .%+-=@%*+=----------------------=*.             #
+ * #                        =%---=@=***-------------------------+.           #
+ * #                       .%----=@%#=+%=------------------------*           #
+ * #                        *+---=@**#%-#=----------+:*------------          #
+ * #                        .#+--=@%%#++++=-------+: :*-----------*          #
+ * #                           +##@%#%%%#=#=----*:..:*------------#.         #
+ * #             **%@@@@@@@#+-.                    -=------------+           #
+ * #       .*@%+.         .                       =------------==            #
+ * #    =@=.....         =@+=%%   +@   --        :*-------------             #
+ * #   @*........                 .#@@@-          +------------=:            #
+ * #   @=.......                                  -+---------------++*.      #
+ * #   *%-...-%@.                     ...         .=------------------:      #
+ * #     -@@=...                                   .+----------------#       #
+ * #        =#@%+-..                               ..+-------------=.        #
+ * #                  .:-=*#%%%@@@:                ...=----------+:  +=+:    #
+ * #                            +%                  ...+---------= .-----:   #
+ * #                           :@.                   ...++--------------+    #
+ * #                           %*                     ....+@%#-----%+        #
+ * #                          :@.                      .....+@:              #
+ * #                                                                         #
+ * # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # #
+ * # NAME       = Event trace buffer                                         #
+ * # PROJECT    = Beursgadget 2025 - Circuit-Cruiser                         #
+ * # DATE       = 17-10-2026                                                 #
+ * # AUTHOR     = Bas Wijnen & Jan-Cees Tjepkema                             #
+ * # WEBSITE    = https://pinkfluffyunicorns.nl                              #
+ * # COPYRIGHT(C) Pink Fluffy Unicorns 2025                                  #
+ * # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # #
+ */
+
+#include <sdkconfig.h>
+#include <stdio.h>
+#include <string.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include "event.h"
+#include "trace.h"
+
+// Version of the dump format. Change it when the format changes, and update
+// tools/trace2chrome.py to match.
+#define TRACE_VERSION 1
+
+// Number of entries that trace_dump writes at once.
+#define DUMP_CHUNK 16
+
+// Start of a dump. It is followed by num_events event names, starting at event
+// code 1 (a length byte, followed by that many characters), num_tasks task
+// names (configMAX_TASK_NAME_LEN bytes each, nul-padded), and num_entries
+// TraceEntry structs, oldest first. Entries with seq 0 are not valid.
+typedef struct TraceHeader {
+	char magic[4];	// "EVTR"
+	uint16_t version;
+	uint16_t entry_size;
+	uint32_t now;	// Time from event_now() when the dump was made.
+	uint16_t num_events;
+	uint16_t num_tasks;
+	uint32_t num_entries;
+} TraceHeader;
+
+#if CONFIG_EVENT_TRACE_ENTRIES > 0
+
+_Static_assert((CONFIG_EVENT_TRACE_ENTRIES &
+	(CONFIG_EVENT_TRACE_ENTRIES - 1)) == 0,
+	"CONFIG_EVENT_TRACE_ENTRIES must be a power of two");
+
+#define TRACE_MASK (CONFIG_EVENT_TRACE_ENTRIES - 1)
+
+static TraceEntry entries[CONFIG_EVENT_TRACE_ENTRIES];
+static uint32_t head;	// Number of entries that were ever recorded.
+
+// Tasks are recognized by their handle. If a task is deleted and a new one
+// gets the same handle, it is shown with the old name.
+static TaskHandle_t task_handles[TRACE_MAX_TASKS];
+static char task_names[TRACE_MAX_TASKS][configMAX_TASK_NAME_LEN];
+
+static uint8_t current_task();
+static bool read_entry(uint32_t n, TraceEntry *copy);
+
+void trace_record(TraceType type, int eventcode, int arg)
+{
+	uint32_t seq = __atomic_fetch_add(&head, 1, __ATOMIC_RELAXED);
+	TraceEntry *entry = &entries[seq & TRACE_MASK];
+	// Mark the entry as invalid while it is written, so a reader does not use
+	// a mix of old and new values.
+	__atomic_store_n(&entry->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	entry->t = event_now();
+	entry->eventcode = eventcode;
+	entry->type = type;
+	entry->task = current_task();
+	entry->arg = arg;
+	__atomic_store_n(&entry->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+// Index of the running task in the task table. It is added if it is new.
+static uint8_t current_task()
+{
+	if (xPortInIsrContext())
+		return TRACE_TASK_ISR;
+	TaskHandle_t self = xTaskGetCurrentTaskHandle();
+	int t;
+	for (t = 0; t < TRACE_MAX_TASKS; ++t) {
+		TaskHandle_t handle = __atomic_load_n(&task_handles[t],
+			__ATOMIC_ACQUIRE);
+		if (handle == self)
+			return t;
+		if (handle != NULL)
+			continue;
+		if (__atomic_compare_exchange_n(&task_handles[t], &handle, self,
+			false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			strlcpy(task_names[t], pcTaskGetName(NULL),
+				sizeof(task_names[t]));
+			return t;
+		}
+		// Another task took this slot; try the next one.
+	}
+	return TRACE_TASK_ISR - 1;
+}
+
+// Copy entry n, counting from the first one that was ever recorded. Returns
+// false if it was overwritten, or is being written.
+static bool read_entry(uint32_t n, TraceEntry *copy)
+{
+	const TraceEntry *entry = &entries[n & TRACE_MASK];
+	uint32_t seq = __atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE);
+	*copy = *entry;
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return seq == n + 1 && __atomic_load_n(&entry->seq, __ATOMIC_RELAXED) == seq;
+}
+
+#endif
+
+// Copy the name of an event, which is freed if the event is deleted. Returns
+// its length, which is 0 if the event is not defined.
+static size_t copy_name(int eventcode, char *buffer, size_t size)
+{
+	unsigned epoch = event_registry_enter();
+	const char *name = event_get_name(eventcode);
+	size_t len = name == NULL ? 0 : strnlen(name, size - 1);
+	if (name != NULL)
+		memcpy(buffer, name, len);
+	event_registry_exit(epoch);
+	buffer[len] = '\0';
+	return len;
+}
+
+void trace_dump(TraceWriter write, void *user_data)
+{
+	int num_events = 0;
+	int code;
+	// Names are written by index in event_defs.
+	for (code = 1; code < MAX_EVENTS; ++code) {
+		if (event_code_at(code) != 0)
+			num_events = code;
+	}
+	TraceHeader header = {
+		.magic = { 'E', 'V', 'T', 'R' },
+		.version = TRACE_VERSION,
+		.entry_size = sizeof(TraceEntry),
+		.now = event_now(),
+		.num_events = num_events,
+	};
+#if CONFIG_EVENT_TRACE_ENTRIES > 0
+	uint32_t end = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+	uint32_t start = end > CONFIG_EVENT_TRACE_ENTRIES ?
+		end - CONFIG_EVENT_TRACE_ENTRIES : 0;
+	header.num_tasks = TRACE_MAX_TASKS;
+	header.num_entries = end - start;
+#endif
+	write(&header, sizeof(header), user_data);
+	for (code = 1; code <= num_events; ++code) {
+		char name[256];
+		uint8_t size = copy_name(event_code_at(code), name, sizeof(name));
+		write(&size, 1, user_data);
+		write(name, size, user_data);
+	}
+#if CONFIG_EVENT_TRACE_ENTRIES > 0
+	write(task_names, sizeof(task_names), user_data);
+	TraceEntry chunk[DUMP_CHUNK];
+	int num = 0;
+	uint32_t n;
+	for (n = start; n != end; ++n) {
+		if (!read_entry(n, &chunk[num]))
+			memset(&chunk[num], 0, sizeof(chunk[num]));
+		if (++num == DUMP_CHUNK) {
+			write(chunk, sizeof(chunk), user_data);
+			num = 0;
+		}
+	}
+	if (num > 0)
+		write(chunk, num * sizeof(TraceEntry), user_data);
+#endif
+}
+
+void trace_print()
+{
+#if CONFIG_EVENT_TRACE_ENTRIES > 0
+	static const char *types[] = {
+		"send", "drop", "isr", "wait", "receive", "resume", "yield",
+		"handled"
+	};
+	uint32_t end = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+	uint32_t start = end > CONFIG_EVENT_TRACE_ENTRIES ?
+		end - CONFIG_EVENT_TRACE_ENTRIES : 0;
+	printf(_("%10s %-16s %-8s %-20s %s\n"), _("time (us)"), _("task"),
+		_("type"), _("event"), _("arg"));
+	uint32_t n;
+	for (n = start; n != end; ++n) {
+		TraceEntry entry;
+		if (!read_entry(n, &entry))
+			continue;
+		const char *task = entry.task == TRACE_TASK_ISR ? "(isr)" :
+			entry.task < TRACE_MAX_TASKS ? task_names[entry.task] : "?";
+		const char *type = entry.type < sizeof(types) / sizeof(*types) ?
+			types[entry.type] : "?";
+		char name[64];
+		if (copy_name(entry.eventcode, name, sizeof(name)) == 0)
+			strcpy(name, "-");
+		printf("%10lu %-16s %-8s %-20s %ld\n", (unsigned long)entry.t, task,
+			type, name, (long)entry.arg);
+	}
+#else
+	printf(_("Event tracing is disabled\n"));
+#endif
+}
@@ -0,0 +1,102 @@
+/*
+ * # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # #
+ * #                                                                         #
+ * #                              +@@+    .-++-------=*=.                    #
+ * #                             +%%@+-------------------+                   #
+ * #                            =@@+*=---------------------==                #
+ * #                         .%+-=@%*+=----------------------=*.             #
+ * #                        =%---=@=***-------------------------+.           #
+ * #                       .%----=@%#=+%=------------------------*           #
+ * #                        *+---=@**#%-#=----------+:*------------          #
+ * #                        .#+--=@%%#++++=-------+: :*-----------*          #
+ * #                           +##@%#%%%#=#=----*:..:*------------#.         #
+ * #             **%@@@@@@@#+-.                    -=------------+           #
+ * #       .*@%+.         .                       =------------==            #
+ * #    =@=.....         =@+=%%   +@   --        :*-------------             #
+ * #   @*........                 .#@@@-          +------------=:            #
+ * #   @=.......                                  -+---------------++*.      #
+ * #   *%-...-%@.                     ...         .=------------------:      #
+ * #     -@@=...                                   .+----------------#       #
+ * #        =#@%+-..                               ..+-------------=.        #
+ * #                  .:-=*#%%%@@@:                ...=----------+:  +=+:    #
+ * #                            +%                  ...+---------= .-----:   #
+ * #                           :@.                   ...++--------------+    #
+ * #                           %*                     ....+@%#-----%+        #
+ * #                          :@.                      .....+@:              #
+ * #                                                                         #
+ * # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # #
+ * # NAME       = Event trace buffer                                         #
+ * # PROJECT    = Beursgadget 2025 - Circuit-Cruiser                         #
+ * # DATE       = 17-10-2026                                                 #
+ * # AUTHOR     = Bas Wijnen & Jan-Cees Tjepkema                             #
+ * # WEBSITE    = https://pinkfluffyunicorns.nl                              #
+ * # COPYRIGHT(C) Pink Fluffy Unicorns 2025                                  #
+ * # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # #
+ */
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sdkconfig.h>
+
+// Kinds of trace entries. The values are part of the dump format; only add new
+// ones at the end.
+typedef enum TraceType {
+	TRACE_SEND,	// Event was sent; arg is the number of receivers that got it.
+	TRACE_DROP,	// A receiver had no room for the event.
+	TRACE_ISR,	// Event was sent from an interrupt handler; arg as TRACE_SEND.
+	TRACE_WAIT,	// Task starts waiting for an event; arg is the timeout in ms.
+	TRACE_RECEIVE,	// Event was received (0 for a timeout); arg is µs in queue.
+	TRACE_RESUME,	// Lua code is resumed; arg is the number of arguments.
+	TRACE_YIELD,	// Lua code yielded or returned; arg is the result code.
+	TRACE_HANDLED,	// Event was handled; arg is the time it took in µs.
+} TraceType;
+
+// Entry of the trace buffer, as it is stored and dumped.
+typedef struct TraceEntry {
+	uint32_t seq;	// Index of the entry plus 1; written last.
+	uint32_t t;	// Time from event_now().
+	uint16_t eventcode;
+	uint8_t type;	// TraceType.
+	uint8_t task;	// Index in the task table, or TRACE_TASK_ISR.
+	int32_t arg;
+} TraceEntry;
+
+// Task index of entries that were recorded by interrupt handlers.
+#define TRACE_TASK_ISR 0xff
+
+// Maximum number of tasks that are recognized by name. Entries of other tasks
+// use TRACE_TASK_ISR - 1.
+#define TRACE_MAX_TASKS 24
+
+// Called by trace_dump to write a part of the dump.
+typedef void (*TraceWriter)(const void *data, size_t size, void *user_data);
+
+#if CONFIG_EVENT_TRACE_ENTRIES > 0
+
+/// @brief Add an entry to the trace buffer.
+/// This does not block, and can be called from interrupt handlers.
+/// @param type The kind of entry.
+/// @param eventcode The event it is about, or 0.
+/// @param arg Extra information; its meaning depends on type.
+void trace_record(TraceType type, int eventcode, int arg);
+
+#else
+
+static inline void trace_record(TraceType /*type*/, int /*eventcode*/,
+	int /*arg*/) {}
+
+#endif
+
+/// @brief Write the trace buffer in binary form.
+/// The format is decoded by tools/trace2chrome.py. Recording continues while
+/// this runs; entries that are overwritten in the meantime are skipped.
+/// @param write The function that writes the data.
+/// @param user_data Opaque value passed to write.
+void trace_dump(TraceWriter write, void *user_data);
+
+/// @brief Print the trace buffer on the console, oldest entry first.
+void trace_print();
+
+#endif
@@ -68,12 +68,25 @@
 #include <lwip/apps/netbiosns.h>
 
 #include "event.h"
+#include "trace.h"
 
 #define MAX_POST_SIZE (1024 * 16)
 
 static ScriptTask *lua_context;
 static httpd_handle_t websocket_hd;
 static int websocket_fd;
+// Events are streamed as binary frames, unless the websocket was opened with
+// ?format=text, which sends the output of print_event for debugging.
+static bool websocket_text;
+// Event definitions that were sent on connection defs_fd: the code that was
+// sent for every index in event_defs, or 0. A deleted event's entry can get
+// a new definition with another code. Every handshake resets defs_fd.
+static int defs_fd = -1;
+static int defs_sent[MAX_EVENTS];
+
+// Types of binary websocket frames; the first byte of every frame.
+#define WS_FRAME_EVENT 0x01
+#define WS_FRAME_DEF 0x02
 static void lua_reply(const char *msg, size_t size, void *user_data);
 // private prototypes
 
@@ -113,11 +126,22 @@ struct async_resp_arg {
 #define MDNS_INSTANCE "esp home web server"
 
 static void wss_monitor_task(ScriptTask *self);
+static void send_text_event(const Event *event);
+static void send_binary_event(const Event *event);
+static void send_frame(httpd_ws_type_t type, uint8_t *payload, size_t len);
+static uint8_t *put_u16(uint8_t *p, uint16_t value);
+static uint8_t *put_u32(uint8_t *p, uint32_t value);
+static uint8_t *put_str(uint8_t *p, const char *str);
 static esp_err_t start_server(const char *base_path);
 static esp_err_t wss_message_handler(httpd_req_t *req);
 static esp_err_t rest_common_get_handler(httpd_req_t *req);
 static const char *parse_query(const char *uri, const char *key, size_t *size);
 static esp_err_t api_file_list_handler(httpd_req_t *req);
+static esp_err_t api_event_stats_handler(httpd_req_t *req);
+static esp_err_t api_trace_handler(httpd_req_t *req);
+static void write_chunk(const void *data, size_t size, void *user_data);
+static void add_histogram(cJSON *entry, const char *stage,
+	const LatencyHistogram *histogram);
 static esp_err_t api_delete_handler(httpd_req_t *req);
 static esp_err_t api_send_file_handler(httpd_req_t *req);
 static esp_err_t set_content_type_from_file(httpd_req_t *req,
@@ -444,6 +468,70 @@ static esp_err_t api_file_list_handler(httpd_req_t *req)
 	return ESP_OK;
 }
 
+static void add_histogram(cJSON *entry, const char *stage,
+	const LatencyHistogram *histogram)
+{
+	cJSON *target = cJSON_AddObjectToObject(entry, stage);
+	cJSON_AddNumberToObject(target, "max", histogram->max);
+	cJSON *count = cJSON_AddArrayToObject(target, "count");
+	int b;
+	for (b = 0; b < EVENT_LATENCY_BUCKETS; ++b)
+		cJSON_AddItemToArray(count, cJSON_CreateNumber(histogram->count[b]));
+}
+
+static esp_err_t api_event_stats_handler(httpd_req_t *req)
+{
+	httpd_resp_set_type(req, "application/json");
+	cJSON *root = cJSON_CreateObject();
+	cJSON *events = cJSON_AddArrayToObject(root, "events");
+	int index;
+	for (index = 1; index < MAX_EVENTS; ++index) {
+		int eventcode = event_code_at(index);
+		EventStats stats;
+		if (!event_get_stats(eventcode, &stats))
+			continue;
+		cJSON *entry = cJSON_CreateObject();
+		cJSON_AddItemToArray(events, entry);
+		unsigned epoch = event_registry_enter();
+		const char *name = event_get_name(eventcode);
+		cJSON_AddStringToObject(entry, "name", name == NULL ? "" : name);
+		event_registry_exit(epoch);
+		cJSON_AddNumberToObject(entry, "sent", stats.sent);
+		cJSON_AddNumberToObject(entry, "delivered", stats.delivered);
+		cJSON_AddNumberToObject(entry, "dropped", stats.dropped);
+		cJSON_AddNumberToObject(entry, "retried", stats.retried);
+		cJSON_AddNumberToObject(entry, "coalesced", stats.coalesced);
+		cJSON_AddNumberToObject(entry, "filtered", stats.filtered);
+		cJSON_AddNumberToObject(entry, "max_depth", stats.max_depth);
+		add_histogram(entry, "source", &stats.source);
+		add_histogram(entry, "queue", &stats.queue);
+		add_histogram(entry, "handler", &stats.handler);
+		add_histogram(entry, "total", &stats.total);
+	}
+
+	const char *reply = cJSON_Print(root);
+	httpd_resp_sendstr(req, reply);
+	free((void *)reply);
+	cJSON_Delete(root);
+	return ESP_OK;
+}
+
+static esp_err_t api_trace_handler(httpd_req_t *req)
+{
+	httpd_resp_set_type(req, "application/octet-stream");
+	httpd_resp_set_hdr(req, "Content-Disposition",
+		"attachment; filename=\"trace.bin\"");
+	trace_dump(write_chunk, req);
+	httpd_resp_send_chunk(req, NULL, 0);
+	return ESP_OK;
+}
+
+static void write_chunk(const void *data, size_t size, void *user_data)
+{
+	if (size > 0)
+		httpd_resp_send_chunk(user_data, data, size);
+}
+
 static esp_err_t api_delete_handler(httpd_req_t *req)
 {
 	size_t size;
@@ -524,6 +612,13 @@ static esp_err_t wss_message_handler(httpd_req_t *req)
 	websocket_fd = httpd_req_to_sockfd(req);
 
 	if (req->method == HTTP_GET) {
+		size_t size;
+		const char *format = parse_query(req->uri, "format", &size);
+		websocket_text = format != NULL && size == 4 &&
+			strncmp(format, "text", 4) == 0;
+		// lwip reuses socket numbers, so a reconnect can get the same fd.
+		// The new page has no definitions yet; send them all again.
+		__atomic_store_n(&defs_fd, -1, __ATOMIC_RELEASE);
 		ESP_LOGI(WEB_TAG, "Handshake done, the new connection was opened");
 		return ESP_OK;
 	}
@@ -609,6 +704,22 @@ static esp_err_t start_server(const char *base_path)
 	};
 	httpd_register_uri_handler(server, &api_file_list_uri);
 
+	httpd_uri_t api_event_stats_uri = {
+		.uri = "/api/event-stats",
+		.method = HTTP_GET,
+		.handler = api_event_stats_handler,
+		.user_ctx = rest_context
+	};
+	httpd_register_uri_handler(server, &api_event_stats_uri);
+
+	httpd_uri_t api_trace_uri = {
+		.uri = "/api/trace",
+		.method = HTTP_GET,
+		.handler = api_trace_handler,
+		.user_ctx = rest_context
+	};
+	httpd_register_uri_handler(server, &api_trace_uri);
+
 	httpd_uri_t api_delete_uri = {
 		.uri = "/api/delete",
 		.method = HTTP_GET,
@@ -654,7 +765,7 @@ err:
 
 void web_main(void)
 {
-	lua_context = create_lua_task();
+	lua_context = create_lua_task("web", 0, 0);
 	// Use a separate task to monitor incoming events.
 	xTaskCreate((TaskFunction_t)&wss_monitor_task, "wss-monitor",
 		4096, lua_context, 0, NULL);
@@ -676,20 +787,149 @@ static void wss_monitor_task(ScriptTask *self)
 {
 	while (true) {
 		Event event;
-		if (!event_wait(-1, &event, self->queue)) {
+		if (!event_task_wait(self, -1, &event)) {
 			// Should not happen.
 			ESP_LOGI(WEB_TAG, _("websocket event timed out?!\n"));
 			continue;
 		}
-		char *prt = print_event(&event);
+		if (websocket_text)
+			send_text_event(&event);
+		else
+			send_binary_event(&event);
 		event_free(&event);
-		ESP_LOGI(WEB_TAG, "Event received for websocket: %s\n", prt);
-		httpd_ws_frame_t ws_pkt;
-		ws_pkt.type = HTTPD_WS_TYPE_TEXT;
-		ws_pkt.fragmented = false;
-		ws_pkt.payload = (uint8_t *)prt;
-		ws_pkt.len = strlen(prt);
-		httpd_ws_send_frame_async(websocket_hd, websocket_fd, &ws_pkt);
-		free(prt);
 	}
 }
+
+static void send_text_event(const Event *event)
+{
+	char *prt = print_event((Event *)event);
+	if (prt == NULL)
+		return;
+	ESP_LOGI(WEB_TAG, "Event received for websocket: %s\n", prt);
+	send_frame(HTTPD_WS_TYPE_TEXT, (uint8_t *)prt, strlen(prt));
+	free(prt);
+}
+
+// Send an event as a binary frame. Little endian:
+//   u8 WS_FRAME_EVENT, u16 eventcode, u8 counts, u32 source time (0 if not
+//   known), then i32 ints, f32 floats, and strings as u16 length + bytes.
+// counts holds num_int in bits 0-2, num_float in bits 3-4 and num_str in bits
+// 5-6, like the event queue encoding. Before the first event of a type on a
+// connection, its definition is sent:
+//   u8 WS_FRAME_DEF, u16 eventcode, u8 counts, then the event name and the
+//   int, float and string parameter names, as u16 length + bytes.
+static void send_binary_event(const Event *event)
+{
+	// The names of the definition are freed if the event is deleted, so they
+	// are only read inside a registry section.
+	unsigned epoch = event_registry_enter();
+	const char *name = event_get_name(event->eventcode);
+	if (name == NULL) {
+		event_registry_exit(epoch);
+		return;
+	}
+	int index = EVENT_INDEX(event->eventcode);
+	const EventType *def = &event_defs[index];
+	int num_int = def->num_int;
+	int num_float = def->num_float;
+	int num_str = def->num_str;
+	uint8_t counts = num_int | num_float << 3 | num_str << 5;
+	if (__atomic_load_n(&defs_fd, __ATOMIC_ACQUIRE) != websocket_fd) {
+		// New connection; it does not know any definitions yet.
+		memset(defs_sent, 0, sizeof(defs_sent));
+		defs_fd = websocket_fd;
+	}
+	int n;
+	uint8_t *def_frame = NULL;
+	size_t def_size = 0;
+	if (defs_sent[index] != event->eventcode) {
+		size_t size = 4 + 2 + strlen(name);
+		for (n = 0; n < num_int; ++n)
+			size += 2 + (def->i[n] == NULL ? 0 : strlen(def->i[n]));
+		for (n = 0; n < num_float; ++n)
+			size += 2 + (def->f[n] == NULL ? 0 : strlen(def->f[n]));
+		for (n = 0; n < num_str; ++n)
+			size += 2 + (def->s[n] == NULL ? 0 : strlen(def->s[n]));
+		def_frame = malloc(size);
+		if (def_frame == NULL) {
+			event_registry_exit(epoch);
+			return;
+		}
+		uint8_t *p = def_frame;
+		*p++ = WS_FRAME_DEF;
+		p = put_u16(p, event->eventcode);
+		*p++ = counts;
+		p = put_str(p, name);
+		for (n = 0; n < num_int; ++n)
+			p = put_str(p, def->i[n]);
+		for (n = 0; n < num_float; ++n)
+			p = put_str(p, def->f[n]);
+		for (n = 0; n < num_str; ++n)
+			p = put_str(p, def->s[n]);
+		def_size = p - def_frame;
+	}
+	event_registry_exit(epoch);
+	if (def_frame != NULL) {
+		send_frame(HTTPD_WS_TYPE_BINARY, def_frame, def_size);
+		free(def_frame);
+		defs_sent[index] = event->eventcode;
+	}
+	// Most events fit in the buffer on the stack.
+	uint8_t buffer[128];
+	size_t size = 8 + 4 * (num_int + num_float);
+	for (n = 0; n < num_str; ++n)
+		size += 2 + (event->s[n] == NULL ? 0 : strlen(event->s[n]));
+	uint8_t *frame = size <= sizeof(buffer) ? buffer : malloc(size);
+	if (frame == NULL)
+		return;
+	uint8_t *p = frame;
+	*p++ = WS_FRAME_EVENT;
+	p = put_u16(p, event->eventcode);
+	*p++ = counts;
+	p = put_u32(p, event->t);
+	for (n = 0; n < num_int; ++n)
+		p = put_u32(p, event->i[n]);
+	for (n = 0; n < num_float; ++n) {
+		uint32_t bits;
+		memcpy(&bits, &event->f[n], sizeof(bits));
+		p = put_u32(p, bits);
+	}
+	for (n = 0; n < num_str; ++n)
+		p = put_str(p, event->s[n]);
+	send_frame(HTTPD_WS_TYPE_BINARY, frame, p - frame);
+	if (frame != buffer)
+		free(frame);
+}
+
+static void send_frame(httpd_ws_type_t type, uint8_t *payload, size_t len)
+{
+	httpd_ws_frame_t ws_pkt;
+	memset(&ws_pkt, 0, sizeof(ws_pkt));
+	ws_pkt.type = type;
+	ws_pkt.fragmented = false;
+	ws_pkt.payload = payload;
+	ws_pkt.len = len;
+	httpd_ws_send_frame_async(websocket_hd, websocket_fd, &ws_pkt);
+}
+
+static uint8_t *put_u16(uint8_t *p, uint16_t value)
+{
+	*p++ = value;
+	*p++ = value >> 8;
+	return p;
+}
+
+static uint8_t *put_u32(uint8_t *p, uint32_t value)
+{
+	p = put_u16(p, value);
+	return put_u16(p, value >> 16);
+}
+
+static uint8_t *put_str(uint8_t *p, const char *str)
+{
+	size_t len = str == NULL ? 0 : strlen(str);
+	p = put_u16(p, len);
+	if (len > 0)
+		memcpy(p, str, len);
+	return p + len;
+}
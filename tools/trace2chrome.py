@@ -0,0 +1,190 @@
+#!/usr/bin/env python3
+# # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # #
+#                                                                         #
+#                              +@@+    .-++-------=*=.                    #
+#                             +%%@+-------------------+                   #
+#                            =@@+*=---------------------==                #
+#                         .%+-=@%*+=----------------------=*.             #
+#                        =%---=@=***-------------------------+.           #
+#                       .%----=@%#=+%=------------------------*           #
+#                        *+---=@**#%-#=----------+:*------------          #
+#                        .#+--=@%%#++++=-------+: :*-----------*          #
+#                           +##@%#%%%#=#=----*:..:*------------#.         #
+#             **%@@@@@@@#+-.                    -=------------+           #
+#       .*@%+.         .                       =------------==            #
+#    =@=.....         =@+=%%   +@   --        :*-------------             #
+#   @*........                 .#@@@-          +------------=:            #
+#   @=.......                                  -+---------------++*.      #
+#   *%-...-%@.                     ...         .=------------------:      #
+#     -@@=...                                   .+----------------#       #
+#        =#@%+-..                               ..+-------------=.        #
+#                  .:-=*#%%%@@@:                ...=----------+:  +=+:    #
+#                            +%                  ...+---------= .-----:   #
+#                           :@.                   ...++--------------+    #
+#                           %*                     ....+@%#-----%+        #
+#                          :@.                      .....+@:              #
+#                                                                         #
+# # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # #
+# NAME       = Event trace decoder                                        #
+# PROJECT    = Beursgadget 2025 - Circuit-Cruiser         	              #
+# DATE       = 17-10-2026                                                 #
+# AUTHOR     = Bas Wijnen & Jan-Cees Tjepkema                             #
+# WEBSITE    = https://pinkfluffyunicorns.nl                              #
+# COPYRIGHT(C) Pink Fluffy Unicorns 2025                                  #
+# # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # #
+
+'''Convert an event trace dump to Chrome trace JSON.
+
+The dump is made by the firmware; download it from /api/trace on the device:
+
+	tools/trace2chrome.py http://circuit-cruiser.local/api/trace -o trace.json
+
+or save it first and pass the file name. Open the result in chrome://tracing
+or https://ui.perfetto.dev. Every task is shown as a thread: waiting for
+events, running Lua code and handling events are slices, sends and drops are
+instant events, and the time that events spent in a queue is a counter.
+'''
+
+import argparse
+import json
+import struct
+import sys
+import urllib.request
+
+# Must match TRACE_VERSION and the structs in main/trace.c and main/trace.h.
+VERSION = 1
+HEADER = struct.Struct('<4sHHIHHI')
+ENTRY = struct.Struct('<IIHBBi')
+TASK_NAME_SIZE = 16
+TASK_ISR = 0xff
+
+SEND, DROP, ISR, WAIT, RECEIVE, RESUME, YIELD, HANDLED = range(8)
+
+
+class Dump:
+	'''Parsed contents of a trace dump.'''
+	def __init__(self, data):
+		magic, version, entry_size, self.now, num_events, num_tasks, \
+			num_entries = HEADER.unpack_from(data)
+		if magic != b'EVTR':
+			raise ValueError('not an event trace dump')
+		if version != VERSION or entry_size != ENTRY.size:
+			raise ValueError('unsupported dump version %d' % version)
+		pos = HEADER.size
+		# Names are stored by index in the event table; the low 8 bits of a code.
+		self.events = {}
+		for code in range(1, num_events + 1):
+			size = data[pos]
+			self.events[code] = data[pos + 1:pos + 1 + size].decode()
+			pos += 1 + size
+		self.tasks = {}
+		for task in range(num_tasks):
+			name = data[pos:pos + TASK_NAME_SIZE].split(b'\0')[0].decode()
+			if name:
+				self.tasks[task] = name
+			pos += TASK_NAME_SIZE
+		self.tasks[TASK_ISR] = 'interrupts'
+		self.entries = []
+		for n in range(num_entries):
+			seq, t, code, kind, task, arg = ENTRY.unpack_from(data, pos)
+			pos += ENTRY.size
+			if seq != 0:
+				self.entries.append((seq, t, code, kind, task, arg))
+
+	def event_name(self, code):
+		return self.events.get(code & 0xff) or 'event %d' % code
+
+	def timeline(self):
+		'''Yield the entries with times in µs since the first one.
+
+		The device clock is 32 bits and wraps around, so times are computed
+		from the difference with the previous entry.'''
+		now = None
+		previous = None
+		for seq, t, code, kind, task, arg in self.entries:
+			if previous is None:
+				now = 0
+			else:
+				delta = (t - previous) & 0xffffffff
+				if delta >= 0x80000000:
+					# Entries from different cores can be slightly out of order.
+					delta -= 0x100000000
+				now += delta
+			previous = t
+			yield now, code, kind, task, arg
+
+
+def convert(dump):
+	'''Return the Chrome trace events for a dump.'''
+	result = []
+	for task, name in dump.tasks.items():
+		result.append({'name': 'thread_name', 'ph': 'M', 'pid': 1,
+			'tid': task, 'args': {'name': name}})
+	waiting = set()
+	running = set()
+	last_event = {}
+	for ts, code, kind, task, arg in dump.timeline():
+		base = {'ts': ts, 'pid': 1, 'tid': task}
+		name = dump.event_name(code)
+		if kind in (SEND, ISR):
+			result.append(dict(base, name='send ' + name, ph='i', s='t',
+				args={'receivers': arg}))
+		elif kind == DROP:
+			result.append(dict(base, name='drop ' + name, ph='i', s='t',
+				cat='drop'))
+		elif kind == WAIT:
+			result.append(dict(base, name='wait', ph='B',
+				args={'timeout': arg}))
+			waiting.add(task)
+		elif kind == RECEIVE:
+			if task in waiting:
+				result.append(dict(base, ph='E'))
+				waiting.discard(task)
+			if code == 0:
+				result.append(dict(base, name='timeout', ph='i', s='t'))
+				last_event[task] = 'timeout'
+				continue
+			result.append(dict(base, name='receive ' + name, ph='i', s='t',
+				args={'queue_us': arg}))
+			result.append(dict(base, name='queue µs', ph='C',
+				args={name: arg}))
+			last_event[task] = name
+		elif kind == RESUME:
+			result.append(dict(base, name='lua ' + last_event.get(task, ''),
+				ph='B'))
+			running.add(task)
+		elif kind == YIELD:
+			if task in running:
+				result.append(dict(base, ph='E', args={'result': arg}))
+				running.discard(task)
+		elif kind == HANDLED:
+			result.append(dict(base, ts=ts - arg, dur=arg,
+				name='handle ' + name, ph='X'))
+	return result
+
+
+def main():
+	parser = argparse.ArgumentParser(description=__doc__.split('\n')[0])
+	parser.add_argument('dump', help='dump file, or URL of /api/trace')
+	parser.add_argument('-o', '--output', default='-',
+		help='output file (default: standard output)')
+	args = parser.parse_args()
+	if '://' in args.dump:
+		with urllib.request.urlopen(args.dump) as response:
+			data = response.read()
+	else:
+		with open(args.dump, 'rb') as f:
+			data = f.read()
+	dump = Dump(data)
+	trace = {'traceEvents': convert(dump), 'displayTimeUnit': 'ms'}
+	if args.output == '-':
+		json.dump(trace, sys.stdout)
+	else:
+		with open(args.output, 'w') as f:
+			json.dump(trace, f)
+	print('%d entries, %d tasks' % (len(dump.entries), len(dump.tasks) - 1),
+		file=sys.stderr)
+
+
+if __name__ == '__main__':
+	main()
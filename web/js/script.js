@@ -38,8 +38,16 @@ const joy_size = 250;
 let receivedAck = 1;
 let lastTime = 0;
 let pendingData = [null, null];
-let gateway = `ws://${window.location.hostname}/api/ws`;
+// Events are received as binary frames; open the page with ?format=text to
+// receive them as text, for debugging.
+const textEvents = new URLSearchParams(window.location.search).get("format") == "text";
+let gateway = `ws://${window.location.hostname}/api/ws` + (textEvents ? "?format=text" : "");
 let websocket;
+// Event definitions by event code, from definition frames.
+let eventDefs = {};
+// Number of events received since the last rate report.
+let eventCount = 0;
+let lastRateTime = Date.now();
 let joyX = null;
 let joyY = null;
 window.addEventListener("load", initPage);
@@ -49,6 +57,7 @@ function initPage() {
     initJoysticks();
     // Run a timer to force data every 50 ms.
     setInterval(systick, 50);
+    setInterval(reportEventRate, 5000);
 
     send_request("api/file-list?folder=lua", fm_processFileList);
 }
@@ -85,6 +94,7 @@ function systick() {
 function initWebSocket() {
     //console.log("Trying to open a WebSocket connection...");
     websocket = new WebSocket(gateway);
+    websocket.binaryType = "arraybuffer";
     websocket.onopen = onOpen;
     websocket.onclose = onClose;
     websocket.onmessage = onMessage; // <-- add this line
@@ -124,6 +134,8 @@ function initJoysticks() {
 function onOpen() {
     console.log("Connection opened");
     document.body.className = "connected";
+    // Event codes may be different after a reconnect.
+    eventDefs = {};
     websocket.send("register_event()");
 }
 function onClose() {
@@ -138,7 +150,92 @@ function debug_show_text(msg) {
     box.scrollTop = box.scrollHeight;   // Scroll to bottom.
 }
 
+// Print the number of events per second that were received, to compare
+// binary and text mode.
+function reportEventRate() {
+    const now = Date.now();
+    if (eventCount > 0)
+        console.log("events/s:", (eventCount * 1000 / (now - lastRateTime)).toFixed(1),
+            textEvents ? "(text)" : "(binary)");
+    eventCount = 0;
+    lastRateTime = now;
+}
+
+// Decode a binary frame; see send_binary_event in webserver.c for the format.
+// Returns an event as {name, fields, t}, or null for a definition frame.
+function decodeFrame(buffer) {
+    const view = new DataView(buffer);
+    const decoder = new TextDecoder();
+    let pos = 0;
+    function u16() { const v = view.getUint16(pos, true); pos += 2; return v; }
+    function str() {
+        const len = u16();
+        const s = decoder.decode(new Uint8Array(buffer, pos, len));
+        pos += len;
+        return s;
+    }
+    const type = view.getUint8(pos++);
+    const code = u16();
+    const counts = view.getUint8(pos++);
+    const numInt = counts & 7;
+    const numFloat = (counts >> 3) & 3;
+    const numStr = (counts >> 5) & 3;
+    if (type == 2) {
+        const def = {name: str(), i: [], f: [], s: []};
+        for (let n = 0; n < numInt; ++n)
+            def.i.push(str());
+        for (let n = 0; n < numFloat; ++n)
+            def.f.push(str());
+        for (let n = 0; n < numStr; ++n)
+            def.s.push(str());
+        eventDefs[code] = def;
+        return null;
+    }
+    if (type != 1)
+        throw new Error("unknown frame type " + type);
+    const def = eventDefs[code] || {name: "event" + code, i: [], f: [], s: []};
+    const t = view.getUint32(pos, true);
+    pos += 4;
+    const fields = {};
+    for (let n = 0; n < numInt; ++n) {
+        fields[def.i[n] || "i" + n] = view.getInt32(pos, true);
+        pos += 4;
+    }
+    for (let n = 0; n < numFloat; ++n) {
+        fields[def.f[n] || "f" + n] = view.getFloat32(pos, true);
+        pos += 4;
+    }
+    for (let n = 0; n < numStr; ++n)
+        fields[def.s[n] || "s" + n] = str();
+    return {name: def.name, fields: fields, t: t};
+}
+
+function setHeader(msg) {
+    const h = document.getElementById("header");
+    while (h.childNodes.length > 0)
+        h.removeChild(h.firstChild);
+    h.appendChild(document.createTextNode(msg));
+}
+
+function handleEvent(evt) {
+    ++eventCount;
+    if (evt.name == "header") {
+        // Header event received; change text in header.
+        setHeader(evt.fields.msg);
+    } else {
+        // Other event received. Not handled; send to log.
+        const args = Object.entries(evt.fields).map(([k, v]) => k + "=" + v);
+        debug_show_text("Event: " + evt.name + "(" + args.join(", ") + ")");
+    }
+}
+
 function onMessage(event) {
+    if (event.data instanceof ArrayBuffer) {
+        const evt = decodeFrame(event.data);
+        if (evt !== null)
+            handleEvent(evt);
+        return;
+    }
     let receivedMessage = event.data;
     //console.log(Date.now(), receivedMessage);
     if (receivedMessage.length > 0) {
@@ -149,13 +246,11 @@ function onMessage(event) {
                 debug_show_text(" Result: " + receivedMessage);
             }
         } else if (receivedMessage[0] == "E") {
+            ++eventCount;
             const m = /^E: header\(msg=(.*)\)$/.exec(receivedMessage);
             if (m !== null) {
                 // Header event received; change text in header.
-                const h = document.getElementById("header");
-                while (h.childNodes.length > 0)
-                    h.removeChild(h.firstChild);
-                h.appendChild(document.createTextNode(m[1]));
+                setHeader(m[1]);
             } else {
                 // Other event received. Not handled; send to log.
                 debug_show_text("Event: " + receivedMessage);
@@ -32,20 +32,42 @@
 -- # COPYRIGHT(C) Pink Fluffy Unicorns 2025                                  #
 -- # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # # #
 
--- Demo LED animation.
+-- Demo LED animation. Every step turns off the previous LED and turns on the
+-- next one in a single update. The steps are paced by a timer, so the
+-- animation does not drift.
+local TICK = event.find('demo_tick')
+if TICK == 0 then
+    TICK = event.new('demo_tick', {}, {}, {})
+end
+event.claim(TICK)
+
+local previous = nil
+local function step(i)
+    local frame = {LED_event(i, BRIGHTRED)}
+    if previous ~= nil then
+        table.insert(frame, 1, LED_event(previous, BLACK))
+    end
+    event.send_many(frame)
+    previous = i
+    event.wait()
+end
+
 for n = 1, 2 do
+    event.timer(TICK, 1000 / 15)
     for i = 6, 11 do
-        set_LED(i, BRIGHTRED)
-        event.wait(math.floor(1000 / 15))
-        set_LED(i, BLACK)
+        step(i)
     end
     for i = 11, 6, -1 do
-        set_LED(i, BRIGHTRED)
-        event.wait(math.floor(1000 / 15))
-        set_LED(i, BLACK)
+        step(i)
     end
-    event.wait(500)
+    set_LED(previous, BLACK)
+    previous = nil
+    -- Pause; this replaces the periodic timer.
+    event.timer(TICK, 500, true)
+    event.wait()
 end
+event.timer(TICK, 0)
+event.release(TICK)
 
 -- Turn on normal lights again.
 reset_LEDs()
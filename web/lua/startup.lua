@@ -51,13 +51,14 @@ PIN_5V = 40
 PIN_SERVO = 41
 PIN_COLOR_LIGHT = 47
 
--- List of browser connections for debugging.
-debuggers = {}
+-- Event for debug messages. Every browser connection that enables debugging
+-- subscribes to it.
+DEBUG = event.new("debug", {}, {}, {"str"})
+debugging = false
 
 function enable_dbg()
-    local e = event.new("debug" .. tostring(#debuggers), {}, {}, {"str"})
-    event.claim(e)
-    table.insert(debuggers, e)
+    event.subscribe(DEBUG)
+    debugging = true
 end
 
 function dbg(msg)
@@ -65,8 +66,8 @@ function dbg(msg)
     print(msg)
 
     -- Send message to all debuggers.
-    for i, d in ipairs(debuggers) do
-        event.send{d, msg}
+    if debugging then
+        event.send{DEBUG, msg}
     end
 end
 
@@ -80,8 +81,7 @@ function trim(c, a)
     js(0, 0)
 end
 
-function parse_color(evt)
-    local e, ir, g, b, r = table.unpack(evt)
+function parse_color(ir, g, b, r)
     r = r / whitebalance[1]
     g = g / whitebalance[2]
     b = b / whitebalance[3]
@@ -115,8 +115,11 @@ print("Wifi credentials:")
 print("\tSSID: " .. wifi.ssid)
 print("\tPassword: " .. wifi.password)
 -- Convenience code for LED.
+function LED_event(n, rgb)
+    return {SETLED_EVENT, n, rgb[1], rgb[2], rgb[3]}
+end
 function set_LED(n, rgb)
-    event.send {SETLED_EVENT, n, rgb[1], rgb[2], rgb[3]}
+    event.send(LED_event(n, rgb))
 end
 BLACK = {0, 0, 0}
 BRIGHTRED = {255, 0, 0}
@@ -186,13 +189,17 @@ function flash(on, off, t)
     if t == 0 then
         t = 100
     end
+    local frame = {}
     for i = 0, 5 do
-        set_LED(i, on)
+        table.insert(frame, LED_event(i, on))
     end
+    event.send_many(frame)
     event.wait(t)
+    frame = {}
     for i = 0, 5 do
-        set_LED(i, off)
+        table.insert(frame, LED_event(i, off))
     end
+    event.send_many(frame)
     set_color()
 end
 
@@ -206,8 +213,7 @@ function set_color()
     else
         c = WHITE
     end
-    set_LED(1, c)
-    set_LED(4, c)
+    event.send_many {LED_event(1, c), LED_event(4, c)}
 end
 
 num_connected = 0
@@ -250,19 +256,17 @@ if not disable_color_sensor then
     -- Color sensor SCL: IO9
     -- Color sensor SDA: IO3
     -- Color sensor address: 1000111: 0x47
-    event.send {
+    -- event.call waits for the reply and returns its values.
+    I2C_DEV = event.call {
         event = 'i2c_new',
         addr = 0x52,
         speed = 100000,
-        reply = MY_EVENT,
+        reply = 0,
         timeout = -1
     }
-    I2C_DEV = event.wait().num
 
     I2C_READ = event.find('i2c_read')
     I2C_WRITE = event.find('i2c_write')
-    MY_I2C = event.new("startup_i2c_reply", {'ir', 'g', 'b', 'r'}, {}, {})
-    event.claim(MY_I2C, true)
 
     -- Initialize some stuff.
     -- Enable color sensor LEDs.
@@ -276,12 +280,14 @@ end
 
 -- Set LEDs for driving.
 function reset_LEDs()
+    local frame = {}
     for i = 0, 5 do
-        set_LED(i, WHITE)
+        table.insert(frame, LED_event(i, WHITE))
     end
     for i, led in ipairs {6, 7, 10, 11} do
-        set_LED(led, RED)
+        table.insert(frame, LED_event(led, RED))
     end
+    event.send_many(frame)
 end
 reset_LEDs()
 
@@ -303,52 +309,61 @@ event.claim(PIN_SENSOR_INTERRUPT, true)
 event.send{SETPIN_EVENT, PIN_COLOR_SENSOR, gpio.FALLING, PIN_SENSOR_INTERRUPT}
 
 -- Example for using the button.
-BUTTON_CHANGE = event.new("button_change", {"pin"}, {}, {})
-event.claim(BUTTON_CHANGE, true)
+BUTTON_CHANGE = event.new("button_change", {"pin", "state"}, {}, {})
+-- Bouncing contacts cause bursts of interrupts; the filter drops those that
+-- do not change the state before they wake up this script. Unlike a rate
+-- limit, it never drops the last edge, so the state is never stale.
+event.claim(BUTTON_CHANGE, true, {field = 'state', changed = true})
 event.send{SETPIN_EVENT, PIN_BUTTON, gpio.CHANGE, BUTTON_CHANGE}
 
-BUTTON_READ = event.new("button", {"value"}, {}, {})
-event.claim(BUTTON_READ, true)
+function read_color()
+    -- Request sensor data; other events wait until it is received.
+    local ir, g, b, r = event.call({I2C_READ, 0x0a040300 | I2C_DEV, 0}, 100)
+    if ir == nil then
+        dbg('No color sensor data')
+        return
+    end
+    r, g, b = parse_color(ir, g, b, r)
+    if r < .4 and g < .4 and b < .4 then
+        -- Black.
+        dbg('Black')
+        throttle = 0.5  -- Normal speed
+    elseif r > b and r > g then
+        -- Red tile.
+        dbg('Red')
+        throttle = 0.4  -- Slow
+    elseif b > g then
+        -- Blue tile.
+        dbg('Blue')
+        throttle = 0.5  -- Normal speed
+    else
+        -- Green tile.
+        dbg('Green')
+        throttle = 0.6  -- Fast
+    end
+    set_color()
+    dbg('ir: ' .. tostring(ir))
+    dbg('r: ' .. tostring(r))
+    dbg('g: ' .. tostring(g))
+    dbg('b: ' .. tostring(b))
+    -- Read status register to reset interrupt.
+    event.send {I2C_READ, 0x07010100 | I2C_DEV, -1}
+end
 
+-- Handlers are called directly with the event parameters as arguments,
+-- without resuming the loop below.
+if not disable_color_sensor then
+    event.on(PIN_SENSOR_INTERRUPT, read_color)
+end
+event.on(PIN_5V_CHANGE, function(pin)
+    event.send{SETLED_EVENT, -1, 0, 0, 0}
+end)
+event.on(BUTTON_CHANGE, function(pin, state)
+    dbg('button state: ' .. tostring(state))
+end)
+
+-- Events without a handler end up here.
 while true do
     local e = event.wait()
-    if not disable_color_sensor and e[1] == MY_I2C then
-        -- Sensor data received after interrupt or at request.
-        local r, g, b = parse_color(e)
-        if r < .4 and g < .4 and b < .4 then
-            -- Black.
-            dbg('Black')
-            throttle = 0.5  -- Normal speed
-        elseif r > b and r > g then
-            -- Red tile.
-            dbg('Red')
-            throttle = 0.4  -- Slow
-        elseif b > g then
-            -- Blue tile.
-            dbg('Blue')
-            throttle = 0.5  -- Normal speed
-        else
-            -- Green tile.
-            dbg('Green')
-            throttle = 0.6  -- Fast
-        end
-        set_color()
-        dbg('ir: ' .. tostring(ir))
-        dbg('r: ' .. tostring(r))
-        dbg('g: ' .. tostring(g))
-        dbg('b: ' .. tostring(b))
-        -- Read status register to reset interrupt.
-        event.send {I2C_READ, 0x07010100 | I2C_DEV, -1}
-    elseif e[1] == PIN_SENSOR_INTERRUPT then
-        -- Request sensor data.
-        event.send {I2C_READ, 0x0a040300 | I2C_DEV, MY_I2C}
-    elseif e[1] == PIN_5V_CHANGE then
-        event.send{SETLED_EVENT, -1, 0, 0, 0}
-    elseif e[1] == BUTTON_CHANGE then
-        event.send{GETPIN_EVENT, PIN_BUTTON, BUTTON_READ}
-    elseif e[1] == BUTTON_READ then
-        dbg('button state: ' .. tostring(e[2]))
-    else
-        dbg('event: ' .. tostring(event))
-    end
+    dbg('event: ' .. tostring(e[1]))
 end